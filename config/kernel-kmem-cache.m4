@@ -70,3 +70,27 @@ AC_DEFUN([SPL_AC_KMEM_CACHE_CREATE_USERCOPY], [
 	])
 	EXTRA_KCFLAGS="$tmp_flags"
 ])
+
+dnl #
+dnl # 4.2 API change,
+dnl # kmem_cache_alloc_bulk() and kmem_cache_free_bulk() were added to
+dnl # allocate and free an array of objects in a single call.
+dnl #
+AC_DEFUN([SPL_AC_KMEM_CACHE_ALLOC_BULK], [
+	AC_MSG_CHECKING([whether kmem_cache_alloc_bulk() exists])
+	SPL_LINUX_TRY_COMPILE([
+		#include <linux/slab.h>
+	],[
+		struct kmem_cache *cachep __attribute__ ((unused)) = NULL;
+		void *objs[1];
+
+		if (kmem_cache_alloc_bulk(cachep, GFP_KERNEL, 1, objs))
+			kmem_cache_free_bulk(cachep, 1, objs);
+	],[
+		AC_MSG_RESULT(yes)
+		AC_DEFINE(HAVE_KMEM_CACHE_ALLOC_BULK, 1,
+			[kmem_cache_alloc_bulk() exists])
+	],[
+		AC_MSG_RESULT(no)
+	])
+])
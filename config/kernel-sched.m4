@@ -35,6 +35,27 @@ AC_DEFUN([SPL_AC_SCHED_SIGNAL_HEADER],
 		AC_MSG_RESULT(no)
 	])
 ])
+dnl #
+dnl # 4.11 API change,
+dnl # The task_struct utime and stime members are u64 nanoseconds, they
+dnl # were previously cputime_t values converted with cputime_to_nsecs().
+dnl #
+AC_DEFUN([SPL_AC_TASK_CPUTIME_NSEC],
+	[AC_MSG_CHECKING([whether task_struct utime is in nanoseconds])
+	SPL_LINUX_TRY_COMPILE([
+		#include <linux/sched.h>
+	],[
+		struct task_struct *tsk __attribute__ ((unused)) = current;
+		u64 *utime __attribute__ ((unused)) = &tsk->utime;
+	],[
+		AC_DEFINE(HAVE_TASK_CPUTIME_NSEC, 1,
+			[task_struct utime is in nanoseconds])
+		AC_MSG_RESULT(yes)
+	],[
+		AC_MSG_RESULT(no)
+	])
+])
+
 dnl #
 dnl # 3.19 API change
 dnl # The io_schedule_timeout() function is present in all 2.6.32 kernels
@@ -123,3 +123,27 @@ AC_DEFUN([SPL_AC_SHRINK_CONTROL_STRUCT], [
 		AC_MSG_RESULT(no)
 	])
 ])
+
+dnl #
+dnl # 3.12 API change,
+dnl # NUMA aware shrinkers are passed the node to reclaim from in
+dnl # struct shrink_control and must set SHRINKER_NUMA_AWARE.
+dnl #
+AC_DEFUN([SPL_AC_SHRINK_CONTROL_NID], [
+	AC_MSG_CHECKING([whether struct shrink_control has nid])
+	SPL_LINUX_TRY_COMPILE([
+		#include <linux/mm.h>
+	],[
+		struct shrink_control sc __attribute__ ((unused));
+		unsigned long flags __attribute__ ((unused));
+
+		sc.nid = 0;
+		flags = SHRINKER_NUMA_AWARE;
+	],[
+		AC_MSG_RESULT(yes)
+		AC_DEFINE(HAVE_SHRINK_CONTROL_NID, 1,
+			[struct shrink_control has nid])
+	],[
+		AC_MSG_RESULT(no)
+	])
+])
@@ -104,6 +104,15 @@ extern struct rw_semaphore spl_kmem_cache_sem;
 #define	SPL_KMEM_CACHE_OBJ_PER_SLAB	8	/* Target objects per slab */
 #define	SPL_KMEM_CACHE_OBJ_PER_SLAB_MIN	1	/* Minimum objects per slab */
 #define	SPL_KMEM_CACHE_ALIGN		8	/* Default object alignment */
+#define	SPL_KMEM_CACHE_DEFRAG_PCT	50	/* Consolidate slabs below N% */
+#define	SPL_KMEM_CACHE_DEFRAG_SLABS	16	/* Max slabs per defrag pass */
+#define	SPL_KMEM_CACHE_GROW_BATCH	0	/* Max slabs per growth batch */
+#define	SPL_KMEM_CACHE_GROW_HIST	16	/* Grow wait histogram size */
+#define	SPL_KMEM_EMERGENCY_HASH_BITS	8	/* Emergency hash buckets */
+#define	SPL_KMEM_MAGAZINE_MIN		2	/* Min objects per magazine */
+#define	SPL_KMEM_MAGAZINE_MAX		256	/* Max objects per magazine */
+#define	SPL_KMEM_MAGAZINE_CONTENTION	3	/* Contended locks to grow */
+#define	SPL_KMEM_MAGAZINE_IDLE		4	/* Idle intervals to shrink */
 #ifdef _LP64
 #define	SPL_KMEM_CACHE_MAX_SIZE		32	/* Max slab size in MB */
 #else
@@ -126,6 +135,7 @@ extern struct rw_semaphore spl_kmem_cache_sem;
 typedef int (*spl_kmem_ctor_t)(void *, void *, int);
 typedef void (*spl_kmem_dtor_t)(void *, void *);
 typedef void (*spl_kmem_reclaim_t)(void *);
+typedef kmem_cbrc_t (*spl_kmem_move_t)(void *, void *, size_t, void *);
 
 typedef struct spl_kmem_magazine {
 	uint32_t		skm_magic;	/* Sanity magic */
@@ -133,6 +143,7 @@ typedef struct spl_kmem_magazine {
 	uint32_t		skm_size;	/* Magazine size */
 	uint32_t		skm_refill;	/* Batch refill size */
 	struct spl_kmem_cache	*skm_cache;	/* Owned by cache */
+	struct list_head	skm_list;	/* Depot list linkage */
 	unsigned long		skm_age;	/* Last cache access */
 	unsigned int		skm_cpu;	/* Owned by cpu */
 	void			*skm_objs[0];	/* Object pointers */
@@ -153,29 +164,69 @@ typedef struct spl_kmem_slab {
 	struct list_head	sks_free_list;	/* Free object list */
 	unsigned long		sks_age;	/* Last modify jiffie */
 	uint32_t		sks_ref;	/* Ref count used objects */
+	boolean_t		sks_defrag;	/* Being consolidated */
+	int			sks_node;	/* Owned by node */
+	uint32_t		sks_color;	/* Offset of first object */
 } spl_kmem_slab_t;
 
 typedef struct spl_kmem_alloc {
 	struct spl_kmem_cache	*ska_cache;	/* Owned by cache */
 	int			ska_flags;	/* Allocation flags */
+	int			ska_node;	/* Preferred node */
+	int			ska_count;	/* Slabs to allocate */
 	taskq_ent_t		ska_tqe;	/* Task queue entry */
 } spl_kmem_alloc_t;
 
+typedef struct spl_kmem_node {
+	struct list_head	skn_complete_list; /* Completely alloc'ed */
+	struct list_head	skn_partial_list;  /* Partially alloc'ed */
+	uint64_t		skn_slab_total;	/* Slab total current */
+	uint64_t		skn_slab_alloc;	/* Slab alloc current */
+	uint64_t		skn_obj_total;	/* Obj total current */
+	uint64_t		skn_obj_alloc;	/* Obj alloc current */
+	uint64_t		skn_obj_local;	/* Objs to local cpus */
+	uint64_t		skn_obj_remote;	/* Objs to remote cpus */
+	spl_kmem_alloc_t	skn_grow;	/* Batched growth request */
+	boolean_t		skn_growing;	/* Batched growth pending */
+} spl_kmem_node_t;
+
 typedef struct spl_kmem_emergency {
-	struct rb_node		ske_node;	/* Emergency tree linkage */
+	struct hlist_node	ske_hlist;	/* Emergency hash linkage */
+	struct spl_kmem_cache	*ske_cache;	/* Owned by cache */
 	unsigned long		ske_obj;	/* Buffer address */
 } spl_kmem_emergency_t;
 
+typedef struct spl_kmem_emergency_bucket {
+	spinlock_t		skeb_lock;	/* Bucket lock */
+	struct hlist_head	skeb_list;	/* Emergency objects */
+	uint64_t		skeb_objs;	/* Objects current */
+	uint64_t		skeb_lookup;	/* Lookups */
+	uint64_t		skeb_hit;	/* Lookups found */
+	uint64_t		skeb_probe;	/* Objects compared */
+} ____cacheline_aligned spl_kmem_emergency_bucket_t;
+
 typedef struct spl_kmem_cache {
 	uint32_t		skc_magic;	/* Sanity magic */
 	uint32_t		skc_name_size;	/* Name length */
 	char			*skc_name;	/* Name string */
 	spl_kmem_magazine_t	**skc_mag;	/* Per-CPU warm cache */
+	spl_kmem_magazine_t	*skc_mag_spare;	/* Linux slab drain spare */
 	uint32_t		skc_mag_size;	/* Magazine size */
 	uint32_t		skc_mag_refill;	/* Magazine refill count */
+	uint32_t		skc_mag_min;	/* Magazine size minimum */
+	uint32_t		skc_mag_max;	/* Magazine size maximum */
+	uint32_t		skc_mag_idle;	/* Idle resize intervals */
+	struct list_head	skc_depot_full;	/* Depot full magazines */
+	struct list_head	skc_depot_empty; /* Depot empty magazines */
+	uint32_t		skc_depot_nfull; /* Depot full count */
+	uint32_t		skc_depot_nempty; /* Depot empty count */
+	uint32_t		skc_depot_max;	/* Depot full limit */
+	unsigned long		skc_depot_age;	/* Last depot exchange */
+	spinlock_t		skc_depot_lock;	/* Depot lock */
 	spl_kmem_ctor_t		skc_ctor;	/* Constructor */
 	spl_kmem_dtor_t		skc_dtor;	/* Destructor */
 	spl_kmem_reclaim_t	skc_reclaim;	/* Reclaimator */
+	spl_kmem_move_t		skc_move;	/* Object move callback */
 	void			*skc_private;	/* Private data */
 	void			*skc_vmp;	/* Unused */
 	struct kmem_cache	*skc_linux_cache; /* Linux slab cache if used */
@@ -184,14 +235,15 @@ typedef struct spl_kmem_cache {
 	uint32_t		skc_obj_align;	/* Object alignment */
 	uint32_t		skc_slab_objs;	/* Objects per slab */
 	uint32_t		skc_slab_size;	/* Slab size */
+	uint32_t		skc_slab_color;	/* Next slab color */
+	uint32_t		skc_slab_color_max; /* Max slab color */
 	uint32_t		skc_delay;	/* Slab reclaim interval */
 	uint32_t		skc_reap;	/* Slab reclaim count */
 	atomic_t		skc_ref;	/* Ref count callers */
 	taskqid_t		skc_taskqid;	/* Slab reclaim task */
+	taskqid_t		skc_defrag_taskqid; /* Slab defrag task */
 	struct list_head	skc_list;	/* List of caches linkage */
-	struct list_head	skc_complete_list; /* Completely alloc'ed */
-	struct list_head	skc_partial_list;  /* Partially alloc'ed */
-	struct rb_root		skc_emergency_tree; /* Min sized objects */
+	spl_kmem_node_t		*skc_node;	/* Per-node slab lists */
 	spinlock_t		skc_lock;	/* Cache lock */
 	spl_wait_queue_head_t	skc_waitq;	/* Allocation waiters */
 	uint64_t		skc_slab_fail;	/* Slab alloc failures */
@@ -206,6 +258,20 @@ typedef struct spl_kmem_cache {
 	uint64_t		skc_obj_deadlock;  /* Obj emergency deadlocks */
 	uint64_t		skc_obj_emergency; /* Obj emergency current */
 	uint64_t		skc_obj_emergency_max; /* Obj emergency max */
+	uint64_t		skc_depot_alloc; /* Depot full mags loaded */
+	uint64_t		skc_depot_free;	/* Depot full mags stored */
+	uint64_t		skc_move_attempt; /* Obj moves attempted */
+	uint64_t		skc_move_yes;	/* Obj moves succeeded */
+	uint64_t		skc_move_later;	/* Obj moves deferred */
+	uint64_t		skc_slab_defrag; /* Slabs reclaimed by defrag */
+	uint64_t		skc_mag_contended; /* Contended slab locks */
+	uint64_t		skc_mag_traffic; /* Magazine refills/flushes */
+	uint64_t		skc_mag_resize;	/* Magazine resize events */
+	uint32_t		skc_grow_lowat;	/* Per-cpu free obj watermark */
+	uint64_t		skc_grow_batch;	/* Batched growth passes */
+	uint64_t		skc_grow_slabs;	/* Slabs grown in batches */
+	/* Histogram of time blocked waiting for new slabs */
+	uint64_t		skc_grow_wait[SPL_KMEM_CACHE_GROW_HIST];
 } spl_kmem_cache_t;
 #define	kmem_cache_t		spl_kmem_cache_t
 
@@ -217,6 +283,10 @@ extern void spl_kmem_cache_set_move(spl_kmem_cache_t *,
 extern void spl_kmem_cache_destroy(spl_kmem_cache_t *skc);
 extern void *spl_kmem_cache_alloc(spl_kmem_cache_t *skc, int flags);
 extern void spl_kmem_cache_free(spl_kmem_cache_t *skc, void *obj);
+extern int spl_kmem_cache_alloc_bulk(spl_kmem_cache_t *skc, int flags,
+    size_t nr, void **objs);
+extern void spl_kmem_cache_free_bulk(spl_kmem_cache_t *skc, size_t nr,
+    void **objs);
 extern void spl_kmem_cache_set_allocflags(spl_kmem_cache_t *skc, gfp_t flags);
 extern void spl_kmem_cache_reap_now(spl_kmem_cache_t *skc, int count);
 extern void spl_kmem_reap(void);
@@ -227,6 +297,10 @@ extern void spl_kmem_reap(void);
 #define	kmem_cache_destroy(skc)		spl_kmem_cache_destroy(skc)
 #define	kmem_cache_alloc(skc, flags)	spl_kmem_cache_alloc(skc, flags)
 #define	kmem_cache_free(skc, obj)	spl_kmem_cache_free(skc, obj)
+#define	kmem_cache_alloc_bulk(skc, flags, nr, objs) \
+    spl_kmem_cache_alloc_bulk(skc, flags, nr, objs)
+#define	kmem_cache_free_bulk(skc, nr, objs) \
+    spl_kmem_cache_free_bulk(skc, nr, objs)
 #define	kmem_cache_reap_now(skc)	\
     spl_kmem_cache_reap_now(skc, skc->skc_reap)
 #define	kmem_reap()			spl_kmem_reap()
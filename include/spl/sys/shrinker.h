@@ -162,7 +162,8 @@ fn(struct shrinker *shrink, struct shrink_control *sc)			\
 static struct shrinker s = {						\
 	.count_objects = x ## _count_objects,				\
 	.scan_objects = x ## _scan_objects,				\
-	.seeks = y							\
+	.seeks = y,							\
+	.flags = SPL_SHRINKER_FLAGS					\
 }
 
 #define	SPL_SHRINKER_CALLBACK_FWD_DECLARE(fn)				\
@@ -206,4 +207,18 @@ typedef int		spl_shrinker_t;
 #define	SHRINK_STOP	(-1)
 #endif
 
+/*
+ * Linux 3.12 and later NUMA aware shrinkers are called once for each
+ * node under memory pressure, with that node passed in sc->nid.  On older
+ * kernels shrinkers are called for all nodes at once which is reported
+ * as NUMA_NO_NODE.
+ */
+#if defined(HAVE_SHRINK_CONTROL_NID)
+#define	SPL_SHRINKER_FLAGS		SHRINKER_NUMA_AWARE
+#define	spl_shrink_control_nid(sc)	((sc)->nid)
+#else
+#define	SPL_SHRINKER_FLAGS		0
+#define	spl_shrink_control_nid(sc)	NUMA_NO_NODE
+#endif
+
 #endif /* SPL_SHRINKER_H */
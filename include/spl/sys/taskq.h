@@ -30,10 +30,12 @@
 #include <linux/slab.h>
 #include <linux/interrupt.h>
 #include <linux/kthread.h>
+#include <linux/llist.h>
 #include <sys/types.h>
 #include <sys/thread.h>
 #include <sys/rwlock.h>
 #include <sys/wait.h>
+#include <sys/kstat.h>
 
 #define	TASKQ_NAMELEN		31
 
@@ -42,6 +44,8 @@
 #define	TASKQ_DYNAMIC		0x00000004
 #define	TASKQ_THREADS_CPU_PCT	0x00000008
 #define	TASKQ_DC_BATCH		0x00000010
+#define	TASKQ_SHARDED		0x00000020
+#define	TASKQ_POLL		0x00000040
 #define	TASKQ_ACTIVE		0x80000000
 
 /*
@@ -57,12 +61,31 @@
 #define	TQ_NEW			0x04000000
 #define	TQ_FRONT		0x08000000
 
+/*
+ * Tasks dispatched with TQ_CLASS(n) are queued on the pending list of
+ * class n.  The classes of a taskq are served in weighted round robin
+ * order, see taskq_set_class_weight().  Tasks dispatched with TQ_FRONT
+ * or TQ_NOQUEUE are run before those of any class.  They are not
+ * charged to a class, so a heavy stream of them can starve the weighted
+ * classes.
+ */
+#define	TQ_CLASS_SHIFT		28
+#define	TQ_CLASS_MASK		0x70000000
+#define	TQ_CLASS(c)		(((c) << TQ_CLASS_SHIFT) & TQ_CLASS_MASK)
+#define	TASKQ_CLASS_MAX		8
+
 /*
  * Reserved taskqid values.
  */
 #define	TASKQID_INVALID		((taskqid_t)0)
 #define	TASKQID_INITIAL		((taskqid_t)1)
 
+/*
+ * The low bits of a sharded taskq's task ids identify the owning shard.
+ */
+#define	TASKQ_SHARD_BITS	6
+#define	TASKQ_SHARD_MAX		(1 << TASKQ_SHARD_BITS)
+
 /*
  * spin_lock(lock) and spin_lock_nested(lock,0) are equivalent,
  * so TQ_LOCK_DYNAMIC must not evaluate to 0
@@ -75,6 +98,70 @@ typedef enum tq_lock_role {
 typedef unsigned long taskqid_t;
 typedef void (task_func_t)(void *);
 
+/*
+ * Hierarchical timer wheel holding a taskq's delayed tasks.
+ */
+#define	TASKQ_WHEEL_BITS	6
+#define	TASKQ_WHEEL_SIZE	(1 << TASKQ_WHEEL_BITS)
+#define	TASKQ_WHEEL_LEVELS	4
+
+typedef struct taskq_wheel {
+	unsigned long		tqw_clk;	/* next tick to process */
+	int			tqw_count;	/* # of delayed tasks */
+	struct list_head	tqw_slots[TASKQ_WHEEL_LEVELS][TASKQ_WHEEL_SIZE];
+} taskq_wheel_t;
+
+/*
+ * Per-CPU taskq statistics.  Bucket N of the histograms counts the tasks
+ * which waited or ran for less than 2^N microseconds, the last bucket
+ * counts all longer times.
+ */
+#define	TASKQ_HIST_BUCKETS	32
+
+typedef struct taskq_stats {
+	uint64_t		tqs_dispatched;	/* tasks dispatched */
+	uint64_t		tqs_completed;	/* tasks completed */
+	uint64_t		tqs_canceled;	/* tasks canceled */
+	uint64_t		tqs_spawned;	/* threads started */
+	uint64_t		tqs_exited;	/* threads exited */
+	uint64_t		tqs_throttled;	/* maxalloc throttle sleeps */
+	uint64_t		tqs_overalloc;	/* allocations over maxalloc */
+	uint64_t		tqs_wait[TASKQ_HIST_BUCKETS]; /* queued time */
+	uint64_t		tqs_exec[TASKQ_HIST_BUCKETS]; /* run time */
+} taskq_stats_t;
+
+/*
+ * Scheduler accounting for the threads of a taskq, times are in nanoseconds.
+ */
+typedef struct taskq_usage {
+	uint64_t		tqu_utime;	/* user cpu time */
+	uint64_t		tqu_stime;	/* system cpu time */
+	uint64_t		tqu_nvcsw;	/* voluntary switches */
+	uint64_t		tqu_nivcsw;	/* involuntary switches */
+	uint64_t		tqu_delay;	/* time waiting to run */
+} taskq_usage_t;
+
+/*
+ * Per-CPU cache of free taskq_ent_t's.  The list is only accessed by its
+ * CPU, other CPUs return entries to it through the remote list.
+ */
+typedef struct taskq_ent_cache {
+	struct list_head	tqec_list;	/* cached taskq_ent_t's */
+	int			tqec_count;	/* # of cached entries */
+	struct llist_head	tqec_remote;	/* entries freed elsewhere */
+	atomic_t		tqec_nremote;	/* # of remote entries */
+} taskq_ent_cache_t;
+
+/*
+ * Completion counter, the callback is run once every task dispatched with
+ * the counter and the holder which initialized it are done with it.
+ */
+typedef struct taskq_done {
+	atomic_t		tqd_pending;	/* # of holds and tasks */
+	task_func_t		*tqd_func;	/* completion callback */
+	void			*tqd_arg;	/* callback argument */
+} taskq_done_t;
+
 typedef struct taskq {
 	spinlock_t		tq_lock;	/* protects taskq_t */
 	char			*tq_name;	/* taskq name */
@@ -82,6 +169,7 @@ typedef struct taskq {
 	struct list_head	tq_thread_list;	/* list of all threads */
 	struct list_head	tq_active_list;	/* list of active threads */
 	int			tq_nactive;	/* # of active threads */
+	int			tq_nstolen;	/* # run by sibling shards */
 	int			tq_nthreads;	/* # of existing threads */
 	int			tq_nspawn;	/* # of threads being spawned */
 	int			tq_maxthreads;	/* # of threads maximum */
@@ -91,32 +179,77 @@ typedef struct taskq {
 	int			tq_nalloc;	/* cur taskq_ent_t pool size */
 	uint_t			tq_flags;	/* flags */
 	taskqid_t		tq_next_id;	/* next pend/work id */
-	taskqid_t		tq_lowest_id;	/* lowest pend/work id */
+	struct list_head	tq_outstanding;	/* incomplete tasks by id */
+	struct hlist_head	*tq_id_hash;	/* incomplete tasks hash */
+	int			tq_id_hash_bits; /* log2 of id hash size */
 	struct list_head	tq_free_list;	/* free taskq_ent_t's */
-	struct list_head	tq_pend_list;	/* pending taskq_ent_t's */
+	taskq_ent_cache_t __percpu *tq_ent_cache; /* per-cpu free entries */
+	struct list_head	tq_pend_list[TASKQ_CLASS_MAX]; /* by class */
+	int			tq_class_weight[TASKQ_CLASS_MAX]; /* quantum */
+	int			tq_class_cur;	/* class being served */
+	int			tq_class_credit; /* tasks left for class */
 	struct list_head	tq_prio_list;	/* priority taskq_ent_t's */
-	struct list_head	tq_delay_list;	/* delayed taskq_ent_t's */
+	struct list_head	tq_blocked_list; /* tasks waiting on others */
+	struct llist_head	tq_ingress;	/* interrupt dispatched tasks */
+	atomic_t		tq_ningress;	/* # of ingress dispatches */
+	taskq_wheel_t		*tq_wheel;	/* delayed taskq_ent_t's */
+	struct timer_list	tq_delay_timer;	/* delayed task timer */
+	struct list_head	tq_poll_list;	/* threads polling for work */
+	int			tq_npollers;	/* # of polling threads */
 	struct list_head	tq_taskqs;	/* all taskq_t's */
 	spl_wait_queue_head_t	tq_work_waitq;	/* new work waitq */
 	spl_wait_queue_head_t	tq_wait_waitq;	/* wait waitq */
 	tq_lock_role_t		tq_lock_class;	/* class when taking tq_lock */
+	struct taskq		*tq_parent;	/* parent of this shard */
+	struct taskq		**tq_shards;	/* shards of this taskq */
+	int			tq_nshards;	/* # of shards */
+	int			tq_shard;	/* index of this shard */
+	atomic_long_t		tq_id_seq;	/* task id sequence */
+	int			*tq_shard_map;	/* shard serving each cpu */
+	struct cpumask		*tq_cpumask;	/* cpus threads may run on */
+	int			tq_cpu_next;	/* last bound cpu */
+	int			tq_node;	/* numa node or NUMA_NO_NODE */
+	int			tq_depth;	/* # of outstanding tasks */
+	int			tq_maxdepth;	/* max # of outstanding tasks */
+	taskq_stats_t __percpu	*tq_stats;	/* per-cpu statistics */
+	kstat_t			*tq_ksp;	/* taskq kstat */
+	taskq_usage_t		tq_usage;	/* usage of exited threads */
+	unsigned long		tq_ctl_time;	/* start of sample window */
+	uint64_t		tq_ctl_arrivals; /* tasks queued in window */
+	uint64_t		tq_ctl_done;	/* tasks run in window */
+	hrtime_t		tq_ctl_busy;	/* task run time in window */
+	int			tq_ctl_load;	/* smoothed load, x100 */
+	int			tq_ctl_target;	/* target # of threads */
 } taskq_t;
 
 typedef struct taskq_ent {
 	spinlock_t		tqent_lock;
 	spl_wait_queue_head_t	tqent_waitq;
-	struct timer_list	tqent_timer;
 	struct list_head	tqent_list;
+	struct list_head	tqent_order;
+	struct hlist_node	tqent_hash;
+	struct llist_node	tqent_llist;	/* ingress or remote free */
+	struct list_head	tqent_waiters;
 	taskqid_t		tqent_id;
 	task_func_t		*tqent_func;
 	void			*tqent_arg;
 	taskq_t			*tqent_taskq;
 	uintptr_t		tqent_flags;
+	int			tqent_class;
+	int			tqent_cpu;	/* cpu which allocated it */
+	int			tqent_ndeps;
+	taskq_done_t		*tqent_done;
 	unsigned long		tqent_birth;
+	hrtime_t		tqent_queued;
+	unsigned long		tqent_expire;
 } taskq_ent_t;
 
 #define	TQENT_FLAG_PREALLOC	0x1
 #define	TQENT_FLAG_CANCEL	0x2
+#define	TQENT_FLAG_DELAY	0x8
+#define	TQENT_FLAG_PEND		0x10
+#define	TQENT_FLAG_BLOCKED	0x20
+#define	TQENT_FLAG_HOLD		0x40
 
 typedef struct taskq_thread {
 	struct list_head	tqt_thread_list;
@@ -126,8 +259,24 @@ typedef struct taskq_thread {
 	taskqid_t		tqt_id;
 	taskq_ent_t		*tqt_task;
 	uintptr_t		tqt_flags;
+	unsigned long		tqt_idle;	/* time of last task */
+	hrtime_t		tqt_ctl_start;	/* task run time accounted */
+	struct list_head	tqt_poll_list;
+	int			tqt_polling;	/* cleared to hand off work */
 } taskq_thread_t;
 
+/*
+ * A task dispatched by taskq_dispatch_many().  The optional tqb_ent is a
+ * preallocated entry as passed to taskq_dispatch_ent().  The id assigned
+ * to the task is returned in tqb_id.
+ */
+typedef struct taskq_batch {
+	task_func_t		*tqb_func;
+	void			*tqb_arg;
+	taskq_ent_t		*tqb_ent;
+	taskqid_t		tqb_id;
+} taskq_batch_t;
+
 /* Global system-wide dynamic task queue available for all consumers */
 extern taskq_t *system_taskq;
 /* Global dynamic task queue for long delay */
@@ -142,10 +291,23 @@ extern taskqid_t taskq_dispatch_delay(taskq_t *, task_func_t, void *,
     uint_t, clock_t);
 extern void taskq_dispatch_ent(taskq_t *, task_func_t, void *, uint_t,
     taskq_ent_t *);
+extern int taskq_dispatch_many(taskq_t *, taskq_batch_t *, int, uint_t);
+extern taskqid_t taskq_dispatch_dep(taskq_t *, task_func_t, void *, uint_t,
+    const taskqid_t *, int, taskq_done_t *);
+extern void taskq_done_init(taskq_done_t *, task_func_t, void *);
+extern void taskq_done_hold(taskq_done_t *);
+extern void taskq_done_rele(taskq_done_t *);
+extern taskqid_t taskq_dispatch_node(taskq_t *, task_func_t, void *, uint_t,
+    int);
 extern int taskq_empty_ent(taskq_ent_t *);
 extern void taskq_init_ent(taskq_ent_t *);
 extern taskq_t *taskq_create(const char *, int, pri_t, int, int, uint_t);
+extern taskq_t *taskq_create_cpumask(const char *, int, pri_t, int, int,
+    uint_t, const struct cpumask *);
+extern taskq_t *taskq_create_node(const char *, int, pri_t, int, int, uint_t,
+    int);
 extern void taskq_destroy(taskq_t *);
+extern void taskq_set_class_weight(taskq_t *, int, int);
 extern void taskq_wait_id(taskq_t *, taskqid_t);
 extern void taskq_wait_outstanding(taskq_t *, taskqid_t);
 extern void taskq_wait(taskq_t *);
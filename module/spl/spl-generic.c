@@ -701,19 +701,23 @@ spl_init(void)
 	if ((rc = spl_tsd_init()))
 		goto out4;
 
-	if ((rc = spl_taskq_init()))
+	/*
+	 * The proc and kstat interfaces are initialized before the taskq
+	 * and kmem cache subsystems which may register their own kstats.
+	 */
+	if ((rc = spl_proc_init()))
 		goto out5;
 
-	if ((rc = spl_kmem_cache_init()))
+	if ((rc = spl_kstat_init()))
 		goto out6;
 
-	if ((rc = spl_vn_init()))
+	if ((rc = spl_taskq_init()))
 		goto out7;
 
-	if ((rc = spl_proc_init()))
+	if ((rc = spl_kmem_cache_init()))
 		goto out8;
 
-	if ((rc = spl_kstat_init()))
+	if ((rc = spl_vn_init()))
 		goto out9;
 
 	if ((rc = spl_zlib_init()))
@@ -724,15 +728,15 @@ spl_init(void)
 	return (rc);
 
 out10:
-	spl_kstat_fini();
+	spl_vn_fini();
 out9:
-	spl_proc_fini();
+	spl_kmem_cache_fini();
 out8:
-	spl_vn_fini();
+	spl_taskq_fini();
 out7:
-	spl_kmem_cache_fini();
+	spl_kstat_fini();
 out6:
-	spl_taskq_fini();
+	spl_proc_fini();
 out5:
 	spl_tsd_fini();
 out4:
@@ -755,11 +759,11 @@ spl_fini(void)
 	printk(KERN_NOTICE "SPL: Unloaded module v%s-%s%s\n",
 	    SPL_META_VERSION, SPL_META_RELEASE, SPL_DEBUG_STR);
 	spl_zlib_fini();
-	spl_kstat_fini();
-	spl_proc_fini();
 	spl_vn_fini();
 	spl_kmem_cache_fini();
 	spl_taskq_fini();
+	spl_kstat_fini();
+	spl_proc_fini();
 	spl_tsd_fini();
 	spl_rw_fini();
 	spl_mutex_fini();
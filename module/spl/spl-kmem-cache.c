@@ -24,14 +24,18 @@
 
 #include <sys/kmem.h>
 #include <sys/kmem_cache.h>
+#include <sys/kstat.h>
 #include <sys/shrinker.h>
 #include <sys/taskq.h>
+#include <sys/time.h>
 #include <sys/timer.h>
 #include <sys/vmem.h>
 #include <sys/wait.h>
 #include <linux/slab.h>
+#include <linux/mm.h>
 #include <linux/swap.h>
 #include <linux/prefetch.h>
+#include <linux/hash.h>
 
 /*
  * Within the scope of spl-kmem.c file the kmem_cache_* definitions
@@ -41,6 +45,8 @@
 #undef kmem_cache_create
 #undef kmem_cache_alloc
 #undef kmem_cache_free
+#undef kmem_cache_alloc_bulk
+#undef kmem_cache_free_bulk
 
 
 /*
@@ -85,12 +91,48 @@ MODULE_PARM_DESC(spl_kmem_cache_expire, "By age (0x1) or low memory (0x2)");
  * automatically determined based on the object size.  Otherwise magazines
  * will be limited to 2-256 objects per magazine (i.e per cpu).  Magazines
  * may never be entirely disabled in this implementation.
+ *
+ * When spl_kmem_cache_magazine_resize is set the magazine size of each
+ * cache is periodically adjusted based on its observed usage.  Magazines
+ * are grown for caches with a contended slab lock and shrunk for idle
+ * caches, they will never exceed the maximum magazine size.
  */
 unsigned int spl_kmem_cache_magazine_size = 0;
 module_param(spl_kmem_cache_magazine_size, uint, 0444);
 MODULE_PARM_DESC(spl_kmem_cache_magazine_size,
 	"Default magazine size (2-256), set automatically (0)");
 
+unsigned int spl_kmem_cache_magazine_resize = 1;
+module_param(spl_kmem_cache_magazine_resize, uint, 0644);
+MODULE_PARM_DESC(spl_kmem_cache_magazine_resize,
+	"Resize magazines based on usage");
+
+/*
+ * Each cache also maintains a depot of full and empty magazines.  When a
+ * per-cpu magazine is exhausted it is exchanged for a full magazine from
+ * the depot, and when it overflows it is exchanged for an empty one.  This
+ * allows objects to be passed between cpus in magazine sized batches
+ * without walking the slab lists.  The spl_kmem_cache_depot_size limits
+ * the number of full magazines each depot may hold, when set to 0 up to
+ * one full magazine per cpu is retained.
+ */
+unsigned int spl_kmem_cache_depot_size = 0;
+module_param(spl_kmem_cache_depot_size, uint, 0444);
+MODULE_PARM_DESC(spl_kmem_cache_depot_size,
+	"Max full magazines per cache depot, one per cpu (0)");
+
+/*
+ * Caches backed by the Linux slab normally construct every object when it
+ * is allocated and destroy it when it is freed.  When
+ * spl_kmem_cache_slab_magazine is set, caches created with a constructor
+ * or destructor instead keep recently freed objects in their constructed
+ * state in per-cpu magazines, as is done for SPL slab backed caches.
+ */
+unsigned int spl_kmem_cache_slab_magazine = 0;
+module_param(spl_kmem_cache_slab_magazine, uint, 0644);
+MODULE_PARM_DESC(spl_kmem_cache_slab_magazine,
+	"Cache constructed Linux slab objects per-cpu");
+
 /*
  * The default behavior is to report the number of objects remaining in the
  * cache.  This allows the Linux VM to repeatedly reclaim objects from the
@@ -149,6 +191,36 @@ unsigned int spl_kmem_cache_kmem_threads = 4;
 module_param(spl_kmem_cache_kmem_threads, uint, 0444);
 MODULE_PARM_DESC(spl_kmem_cache_kmem_threads,
 	"Number of spl_kmem_cache threads");
+
+/*
+ * When the free objects on a node fall below the cache's low watermark
+ * up to spl_kmem_cache_grow_batch new slabs are allocated for that node
+ * in a single pass by the spl_kmem_grow task queue.  This keeps enough
+ * free objects available that allocations rarely need to wait for a new
+ * slab.  Since the slabs are pinned until they are reclaimed this is
+ * disabled by default, set this value to enable growing in advance.
+ */
+unsigned int spl_kmem_cache_grow_batch = SPL_KMEM_CACHE_GROW_BATCH;
+module_param(spl_kmem_cache_grow_batch, uint, 0644);
+MODULE_PARM_DESC(spl_kmem_cache_grow_batch,
+	"Maximum slabs allocated per growth batch");
+
+/*
+ * Caches which register a move callback with kmem_cache_set_move() are
+ * periodically consolidated.  Live objects are relocated out of sparsely
+ * populated slabs, those with fewer than spl_kmem_cache_defrag_pct percent
+ * of their objects allocated, in to fuller slabs so the emptied slabs can
+ * be released.  Consolidation may be disabled at run time by setting
+ * spl_kmem_cache_defrag to 0.
+ */
+unsigned int spl_kmem_cache_defrag = 1;
+module_param(spl_kmem_cache_defrag, uint, 0644);
+MODULE_PARM_DESC(spl_kmem_cache_defrag, "Consolidate fragmented slabs");
+
+unsigned int spl_kmem_cache_defrag_pct = SPL_KMEM_CACHE_DEFRAG_PCT;
+module_param(spl_kmem_cache_defrag_pct, uint, 0644);
+MODULE_PARM_DESC(spl_kmem_cache_defrag_pct,
+	"Consolidate slabs less than N% allocated");
 /* END CSTYLED */
 
 /*
@@ -183,25 +255,39 @@ MODULE_PARM_DESC(spl_kmem_cache_kmem_threads,
  * constrain the size of the slab caches and their performance.
  */
 
-struct list_head spl_kmem_cache_list;   /* List of caches */
-struct rw_semaphore spl_kmem_cache_sem; /* Cache list lock */
+LIST_HEAD(spl_kmem_cache_list);		/* List of caches */
+DECLARE_RWSEM(spl_kmem_cache_sem);	/* Cache list lock */
 taskq_t *spl_kmem_cache_taskq;		/* Task queue for ageing / reclaim */
+taskq_t *spl_kmem_cache_grow_taskq;	/* Task queue for slab growth */
 
 static void spl_cache_shrink(spl_kmem_cache_t *skc, void *obj);
+static void spl_cache_defrag(void *data);
+static void spl_cache_grow_batch(void *data);
+static spl_kmem_magazine_t *spl_magazine_alloc(spl_kmem_cache_t *skc,
+    int cpu, gfp_t lflags);
+static void spl_magazine_free(spl_kmem_magazine_t *skm);
 
 SPL_SHRINKER_CALLBACK_FWD_DECLARE(spl_kmem_cache_generic_shrinker);
 SPL_SHRINKER_DECLARE(spl_kmem_cache_shrinker,
 	spl_kmem_cache_generic_shrinker, KMC_DEFAULT_SEEKS);
 
+/*
+ * Slabs are allocated from the preferred node when possible.  This cannot
+ * be requested for vmem backed slabs because __vmalloc_node() is not
+ * available to modules, however __vmalloc() will allocate its pages from
+ * the local node of the calling cpu.
+ */
 static void *
-kv_alloc(spl_kmem_cache_t *skc, int size, int flags)
+kv_alloc(spl_kmem_cache_t *skc, int size, int flags, int node)
 {
 	gfp_t lflags = kmem_flags_convert(flags);
+	struct page *page;
 	void *ptr;
 
 	if (skc->skc_flags & KMC_KMEM) {
 		ASSERT(ISP2(size));
-		ptr = (void *)__get_free_pages(lflags, get_order(size));
+		page = alloc_pages_node(node, lflags, get_order(size));
+		ptr = page ? page_address(page) : NULL;
 	} else {
 		ptr = __vmalloc(size, lflags | __GFP_HIGHMEM, PAGE_KERNEL);
 	}
@@ -235,6 +321,19 @@ kv_free(spl_kmem_cache_t *skc, void *ptr, int size)
 	}
 }
 
+/*
+ * Returns the node the memory at the passed address was allocated from,
+ * which may differ from the preferred node passed to kv_alloc().
+ */
+static int
+kv_node(spl_kmem_cache_t *skc, void *ptr)
+{
+	if (skc->skc_flags & KMC_KMEM)
+		return (page_to_nid(virt_to_page(ptr)));
+	else
+		return (page_to_nid(vmalloc_to_page(ptr)));
+}
+
 /*
  * Required space for each aligned sks.
  */
@@ -267,6 +366,36 @@ spl_sko_from_obj(spl_kmem_cache_t *skc, void *obj)
 	    skc->skc_obj_align, uint32_t));
 }
 
+/*
+ * Lookup the per-node slab lists and counters for a slab.
+ */
+static inline spl_kmem_node_t *
+spl_slab_node(spl_kmem_cache_t *skc, spl_kmem_slab_t *sks)
+{
+	return (&skc->skc_node[sks->sks_node]);
+}
+
+/*
+ * Lookup the address of the Nth object in an on-slab slab.
+ */
+static inline void *
+spl_slab_obj(spl_kmem_cache_t *skc, spl_kmem_slab_t *sks, uint32_t i)
+{
+	return ((void *)sks + spl_sks_size(skc) + sks->sks_color +
+	    (i * spl_obj_size(skc)));
+}
+
+/*
+ * Distance between successive slab colors.  This must be a multiple of
+ * the object alignment, and is at least a cache line so that differently
+ * colored slabs map their objects to different cache sets.
+ */
+static inline uint32_t
+spl_slab_color_step(spl_kmem_cache_t *skc)
+{
+	return (MAX(skc->skc_obj_align, L1_CACHE_BYTES));
+}
+
 /*
  * Required space for each offslab object taking in to account alignment
  * restrictions and the power-of-two requirement of kv_alloc().
@@ -309,15 +438,15 @@ spl_offslab_size(spl_kmem_cache_t *skc)
  * +------------------------+       +-----------------+     v
  */
 static spl_kmem_slab_t *
-spl_slab_alloc(spl_kmem_cache_t *skc, int flags)
+spl_slab_alloc(spl_kmem_cache_t *skc, int flags, int node)
 {
 	spl_kmem_slab_t *sks;
 	spl_kmem_obj_t *sko, *n;
 	void *base, *obj;
-	uint32_t obj_size, offslab_size = 0;
+	uint32_t offslab_size = 0;
 	int i,  rc = 0;
 
-	base = kv_alloc(skc, skc->skc_slab_size, flags);
+	base = kv_alloc(skc, skc->skc_slab_size, flags, node);
 	if (base == NULL)
 		return (NULL);
 
@@ -329,20 +458,36 @@ spl_slab_alloc(spl_kmem_cache_t *skc, int flags)
 	INIT_LIST_HEAD(&sks->sks_list);
 	INIT_LIST_HEAD(&sks->sks_free_list);
 	sks->sks_ref = 0;
-	obj_size = spl_obj_size(skc);
+	sks->sks_defrag = B_FALSE;
+	sks->sks_node = kv_node(skc, base);
+	sks->sks_color = 0;
 
-	if (skc->skc_flags & KMC_OFFSLAB)
+	/*
+	 * Successive on-slab slabs start their objects at rotating offsets
+	 * within the unused space at the end of the slab.  Without this the
+	 * objects in every slab map to the same cache sets, which for power
+	 * of two object sizes concentrates accesses on a few of those sets.
+	 */
+	if (skc->skc_flags & KMC_OFFSLAB) {
 		offslab_size = spl_offslab_size(skc);
+	} else if (skc->skc_slab_color_max > 0) {
+		spin_lock(&skc->skc_lock);
+		sks->sks_color = skc->skc_slab_color;
+		skc->skc_slab_color += spl_slab_color_step(skc);
+		if (skc->skc_slab_color > skc->skc_slab_color_max)
+			skc->skc_slab_color = 0;
+		spin_unlock(&skc->skc_lock);
+	}
 
 	for (i = 0; i < sks->sks_objs; i++) {
 		if (skc->skc_flags & KMC_OFFSLAB) {
-			obj = kv_alloc(skc, offslab_size, flags);
+			obj = kv_alloc(skc, offslab_size, flags, node);
 			if (!obj) {
 				rc = -ENOMEM;
 				goto out;
 			}
 		} else {
-			obj = base + spl_sks_size(skc) + (i * obj_size);
+			obj = spl_slab_obj(skc, sks, i);
 		}
 
 		ASSERT(IS_P2ALIGNED(obj, skc->skc_obj_align));
@@ -379,52 +524,71 @@ spl_slab_free(spl_kmem_slab_t *sks,
     struct list_head *sks_list, struct list_head *sko_list)
 {
 	spl_kmem_cache_t *skc;
+	spl_kmem_node_t *skn;
 
 	ASSERT(sks->sks_magic == SKS_MAGIC);
 	ASSERT(sks->sks_ref == 0);
 
 	skc = sks->sks_cache;
 	ASSERT(skc->skc_magic == SKC_MAGIC);
+	skn = spl_slab_node(skc, sks);
 
 	/*
 	 * Update slab/objects counters in the cache, then remove the
-	 * slab from the skc->skc_partial_list.  Finally add the slab
+	 * slab from the node's partial list.  Finally add the slab
 	 * and all its objects in to the private work lists where the
 	 * destructors will be called and the memory freed to the system.
 	 */
 	skc->skc_obj_total -= sks->sks_objs;
 	skc->skc_slab_total--;
+	skn->skn_obj_total -= sks->sks_objs;
+	skn->skn_slab_total--;
 	list_del(&sks->sks_list);
 	list_add(&sks->sks_list, sks_list);
 	list_splice_init(&sks->sks_free_list, sko_list);
 }
 
 /*
- * Reclaim empty slabs at the end of the partial list.
+ * Reclaim empty slabs at the end of the passed node's partial list, or
+ * of every node's partial list when NUMA_NO_NODE is passed.  The number
+ * of objects released with the slabs is returned.
  */
-static void
-spl_slab_reclaim(spl_kmem_cache_t *skc)
+static uint64_t
+spl_slab_reclaim_node(spl_kmem_cache_t *skc, int target)
 {
 	spl_kmem_slab_t *sks, *m;
 	spl_kmem_obj_t *sko, *n;
 	LIST_HEAD(sks_list);
 	LIST_HEAD(sko_list);
+	uint64_t objs = 0;
 	uint32_t size = 0;
+	int node;
 
 	/*
 	 * Empty slabs and objects must be moved to a private list so they
 	 * can be safely freed outside the spin lock.  All empty slabs are
-	 * at the end of skc->skc_partial_list, therefore once a non-empty
-	 * slab is found we can stop scanning.
+	 * at the end of each node's partial list, therefore once a non-empty
+	 * slab is found we can stop scanning.  Slabs which are in the
+	 * process of being consolidated are skipped, they will be released
+	 * by spl_slab_defrag() once it has finished with them.
 	 */
 	spin_lock(&skc->skc_lock);
-	list_for_each_entry_safe_reverse(sks, m,
-	    &skc->skc_partial_list, sks_list) {
+	for_each_node(node) {
+		if (target != NUMA_NO_NODE && node != target)
+			continue;
 
-		if (sks->sks_ref > 0)
-			break;
+		list_for_each_entry_safe_reverse(sks, m,
+		    &skc->skc_node[node].skn_partial_list, sks_list) {
+
+			if (sks->sks_ref > 0)
+				break;
+
+			if (sks->sks_defrag)
+				continue;
 
-		spl_slab_free(sks, &sks_list, &sko_list);
+			objs += sks->sks_objs;
+			spl_slab_free(sks, &sks_list, &sko_list);
+		}
 	}
 	spin_unlock(&skc->skc_lock);
 
@@ -450,68 +614,139 @@ spl_slab_reclaim(spl_kmem_cache_t *skc)
 		ASSERT(sks->sks_magic == SKS_MAGIC);
 		kv_free(skc, sks, skc->skc_slab_size);
 	}
+
+	return (objs);
+}
+
+static void
+spl_slab_reclaim(spl_kmem_cache_t *skc)
+{
+	(void) spl_slab_reclaim_node(skc, NUMA_NO_NODE);
+}
+
+/*
+ * Select the node whose partial slabs should be used to satisfy an
+ * allocation from a cpu on the passed node.  Slabs on the local node are
+ * always preferred, otherwise the nearest node with partial slabs is
+ * used.  NULL is returned when there are no partial slabs on any node.
+ * Must be called with the 'skc->skc_lock' held.
+ */
+static spl_kmem_node_t *
+spl_cache_node(spl_kmem_cache_t *skc, int node)
+{
+	spl_kmem_node_t *skn = NULL;
+	int i, distance = INT_MAX;
+
+	if (!list_empty(&skc->skc_node[node].skn_partial_list))
+		return (&skc->skc_node[node]);
+
+	for_each_node(i) {
+		if (list_empty(&skc->skc_node[i].skn_partial_list))
+			continue;
+
+		if (node_distance(node, i) < distance) {
+			distance = node_distance(node, i);
+			skn = &skc->skc_node[i];
+		}
+	}
+
+	return (skn);
+}
+
+/*
+ * Emergency objects from all caches are tracked in a single hash keyed by
+ * the object address.  Each bucket has its own lock so while emergency
+ * objects are outstanding the lookup required on every free does not
+ * serialize on the cache lock.  Emergency objects are allocated as whole
+ * pages so their addresses are unique across all caches.
+ */
+static spl_kmem_emergency_bucket_t
+    spl_kmem_emergency_hash[1 << SPL_KMEM_EMERGENCY_HASH_BITS];
+
+typedef struct spl_kmem_emergency_stats {
+	kstat_named_t	skes_objs;
+	kstat_named_t	skes_lookup;
+	kstat_named_t	skes_hit;
+	kstat_named_t	skes_probe;
+} spl_kmem_emergency_stats_t;
+
+static spl_kmem_emergency_stats_t spl_kmem_emergency_stats = {
+	{ "objects",		KSTAT_DATA_UINT64 },
+	{ "lookups",		KSTAT_DATA_UINT64 },
+	{ "hits",		KSTAT_DATA_UINT64 },
+	{ "probes",		KSTAT_DATA_UINT64 },
+};
+
+static kstat_t *spl_kmem_emergency_ksp = NULL;
+
+static spl_kmem_emergency_bucket_t *
+spl_emergency_bucket(unsigned long address)
+{
+	return (&spl_kmem_emergency_hash[hash_long(address >> PAGE_SHIFT,
+	    SPL_KMEM_EMERGENCY_HASH_BITS)]);
 }
 
+/*
+ * Locate the passed object in its hash bucket.  The number of objects
+ * compared is accounted for to report the cost of these lookups.  Must
+ * be called with the 'skeb->skeb_lock' held.
+ */
 static spl_kmem_emergency_t *
-spl_emergency_search(struct rb_root *root, void *obj)
+spl_emergency_search(spl_kmem_emergency_bucket_t *skeb, void *obj)
 {
-	struct rb_node *node = root->rb_node;
+	struct hlist_node *node;
 	spl_kmem_emergency_t *ske;
 	unsigned long address = (unsigned long)obj;
 
-	while (node) {
-		ske = container_of(node, spl_kmem_emergency_t, ske_node);
+	skeb->skeb_lookup++;
 
-		if (address < ske->ske_obj)
-			node = node->rb_left;
-		else if (address > ske->ske_obj)
-			node = node->rb_right;
-		else
+	hlist_for_each(node, &skeb->skeb_list) {
+		ske = hlist_entry(node, spl_kmem_emergency_t, ske_hlist);
+		skeb->skeb_probe++;
+
+		if (ske->ske_obj == address) {
+			skeb->skeb_hit++;
 			return (ske);
+		}
 	}
 
 	return (NULL);
 }
 
 static int
-spl_emergency_insert(struct rb_root *root, spl_kmem_emergency_t *ske)
+spl_emergency_insert(spl_kmem_emergency_bucket_t *skeb,
+    spl_kmem_emergency_t *ske)
 {
-	struct rb_node **new = &(root->rb_node), *parent = NULL;
+	struct hlist_node *node;
 	spl_kmem_emergency_t *ske_tmp;
-	unsigned long address = ske->ske_obj;
-
-	while (*new) {
-		ske_tmp = container_of(*new, spl_kmem_emergency_t, ske_node);
 
-		parent = *new;
-		if (address < ske_tmp->ske_obj)
-			new = &((*new)->rb_left);
-		else if (address > ske_tmp->ske_obj)
-			new = &((*new)->rb_right);
-		else
+	hlist_for_each(node, &skeb->skeb_list) {
+		ske_tmp = hlist_entry(node, spl_kmem_emergency_t, ske_hlist);
+		if (ske_tmp->ske_obj == ske->ske_obj)
 			return (0);
 	}
 
-	rb_link_node(&ske->ske_node, parent, new);
-	rb_insert_color(&ske->ske_node, root);
+	hlist_add_head(&ske->ske_hlist, &skeb->skeb_list);
+	skeb->skeb_objs++;
 
 	return (1);
 }
 
 /*
- * Allocate a single emergency object and track it in a red black tree.
+ * Allocate a single emergency object and track it in the emergency hash.
  */
 static int
 spl_emergency_alloc(spl_kmem_cache_t *skc, int flags, void **obj)
 {
 	gfp_t lflags = kmem_flags_convert(flags);
+	spl_kmem_emergency_bucket_t *skeb;
 	spl_kmem_emergency_t *ske;
 	int order = get_order(skc->skc_obj_size);
 	int empty;
 
 	/* Last chance use a partial slab if one now exists */
 	spin_lock(&skc->skc_lock);
-	empty = list_empty(&skc->skc_partial_list);
+	empty = (spl_cache_node(skc, numa_node_id()) == NULL);
 	spin_unlock(&skc->skc_lock);
 	if (!empty)
 		return (-EEXIST);
@@ -526,17 +761,30 @@ spl_emergency_alloc(spl_kmem_cache_t *skc, int flags, void **obj)
 		return (-ENOMEM);
 	}
 
+	ske->ske_cache = skc;
+	skeb = spl_emergency_bucket(ske->ske_obj);
+
+	/*
+	 * The object is accounted for before it is visible in the hash so
+	 * skc_obj_emergency is never zero while it may be freed.
+	 */
 	spin_lock(&skc->skc_lock);
-	empty = spl_emergency_insert(&skc->skc_emergency_tree, ske);
-	if (likely(empty)) {
-		skc->skc_obj_total++;
-		skc->skc_obj_emergency++;
-		if (skc->skc_obj_emergency > skc->skc_obj_emergency_max)
-			skc->skc_obj_emergency_max = skc->skc_obj_emergency;
-	}
+	skc->skc_obj_total++;
+	skc->skc_obj_emergency++;
+	if (skc->skc_obj_emergency > skc->skc_obj_emergency_max)
+		skc->skc_obj_emergency_max = skc->skc_obj_emergency;
 	spin_unlock(&skc->skc_lock);
 
+	spin_lock(&skeb->skeb_lock);
+	empty = spl_emergency_insert(skeb, ske);
+	spin_unlock(&skeb->skeb_lock);
+
 	if (unlikely(!empty)) {
+		spin_lock(&skc->skc_lock);
+		skc->skc_obj_emergency--;
+		skc->skc_obj_total--;
+		spin_unlock(&skc->skc_lock);
+
 		free_pages(ske->ske_obj, order);
 		kfree(ske);
 		return (-EINVAL);
@@ -548,32 +796,112 @@ spl_emergency_alloc(spl_kmem_cache_t *skc, int flags, void **obj)
 }
 
 /*
- * Locate the passed object in the red black tree and free it.
+ * Locate the passed object in the emergency hash and free it.
  */
 static int
 spl_emergency_free(spl_kmem_cache_t *skc, void *obj)
 {
+	spl_kmem_emergency_bucket_t *skeb;
 	spl_kmem_emergency_t *ske;
 	int order = get_order(skc->skc_obj_size);
 
-	spin_lock(&skc->skc_lock);
-	ske = spl_emergency_search(&skc->skc_emergency_tree, obj);
+	skeb = spl_emergency_bucket((unsigned long)obj);
+
+	spin_lock(&skeb->skeb_lock);
+	ske = spl_emergency_search(skeb, obj);
 	if (ske) {
-		rb_erase(&ske->ske_node, &skc->skc_emergency_tree);
-		skc->skc_obj_emergency--;
-		skc->skc_obj_total--;
+		ASSERT3P(ske->ske_cache, ==, skc);
+		hlist_del(&ske->ske_hlist);
+		skeb->skeb_objs--;
 	}
-	spin_unlock(&skc->skc_lock);
+	spin_unlock(&skeb->skeb_lock);
 
 	if (ske == NULL)
 		return (-ENOENT);
 
+	spin_lock(&skc->skc_lock);
+	skc->skc_obj_emergency--;
+	skc->skc_obj_total--;
+	spin_unlock(&skc->skc_lock);
+
 	free_pages(ske->ske_obj, order);
 	kfree(ske);
 
 	return (0);
 }
 
+/*
+ * Sum the per-bucket counters for the spl:0:kmem_emergency kstat.
+ */
+static int
+spl_emergency_kstat_update(kstat_t *ksp, int rw)
+{
+	spl_kmem_emergency_stats_t *skes = ksp->ks_data;
+	spl_kmem_emergency_bucket_t *skeb;
+	uint64_t objs = 0, lookup = 0, hit = 0, probe = 0;
+	int i;
+
+	if (rw == KSTAT_WRITE)
+		return (EACCES);
+
+	for (i = 0; i < ARRAY_SIZE(spl_kmem_emergency_hash); i++) {
+		skeb = &spl_kmem_emergency_hash[i];
+		spin_lock(&skeb->skeb_lock);
+		objs += skeb->skeb_objs;
+		lookup += skeb->skeb_lookup;
+		hit += skeb->skeb_hit;
+		probe += skeb->skeb_probe;
+		spin_unlock(&skeb->skeb_lock);
+	}
+
+	skes->skes_objs.value.ui64 = objs;
+	skes->skes_lookup.value.ui64 = lookup;
+	skes->skes_hit.value.ui64 = hit;
+	skes->skes_probe.value.ui64 = probe;
+
+	return (0);
+}
+
+static void
+spl_emergency_init(void)
+{
+	spl_kmem_emergency_bucket_t *skeb;
+	int i;
+
+	for (i = 0; i < ARRAY_SIZE(spl_kmem_emergency_hash); i++) {
+		skeb = &spl_kmem_emergency_hash[i];
+		spin_lock_init(&skeb->skeb_lock);
+		INIT_HLIST_HEAD(&skeb->skeb_list);
+		skeb->skeb_objs = 0;
+		skeb->skeb_lookup = 0;
+		skeb->skeb_hit = 0;
+		skeb->skeb_probe = 0;
+	}
+
+	spl_kmem_emergency_ksp = kstat_create("spl", 0, "kmem_emergency",
+	    "misc", KSTAT_TYPE_NAMED, sizeof (spl_kmem_emergency_stats) /
+	    sizeof (kstat_named_t), KSTAT_FLAG_VIRTUAL);
+	if (spl_kmem_emergency_ksp != NULL) {
+		spl_kmem_emergency_ksp->ks_data = &spl_kmem_emergency_stats;
+		spl_kmem_emergency_ksp->ks_update = spl_emergency_kstat_update;
+		kstat_install(spl_kmem_emergency_ksp);
+	}
+}
+
+static void
+spl_emergency_fini(void)
+{
+	int i;
+
+	if (spl_kmem_emergency_ksp != NULL) {
+		kstat_delete(spl_kmem_emergency_ksp);
+		spl_kmem_emergency_ksp = NULL;
+	}
+
+	for (i = 0; i < ARRAY_SIZE(spl_kmem_emergency_hash); i++)
+		ASSERT(hlist_empty(&spl_kmem_emergency_hash[i].skeb_list));
+}
+
 /*
  * Release objects from the per-cpu magazine back to their slab.  The flush
  * argument contains the max number of entries to remove from the magazine.
@@ -585,6 +913,7 @@ __spl_cache_flush(spl_kmem_cache_t *skc, spl_kmem_magazine_t *skm, int flush)
 
 	ASSERT(skc->skc_magic == SKC_MAGIC);
 	ASSERT(skm->skm_magic == SKM_MAGIC);
+	ASSERT0(skc->skc_flags & KMC_SLAB);
 
 	for (i = 0; i < count; i++)
 		spl_cache_shrink(skc, skm->skm_objs[i]);
@@ -594,14 +923,165 @@ __spl_cache_flush(spl_kmem_cache_t *skc, spl_kmem_magazine_t *skm, int flush)
 	    sizeof (void *) * skm->skm_avail);
 }
 
+/*
+ * Acquire the cache lock on behalf of a magazine refill or flush.  These
+ * are the only paths where per-cpu magazines touch the slab lists, so the
+ * number of contended acquisitions and the total number of trips are
+ * recorded for spl_magazine_resize().
+ */
+static void
+spl_cache_lock(spl_kmem_cache_t *skc)
+{
+	if (unlikely(!spin_trylock(&skc->skc_lock))) {
+		spin_lock(&skc->skc_lock);
+		skc->skc_mag_contended++;
+	}
+
+	skc->skc_mag_traffic++;
+}
+
 static void
 spl_cache_flush(spl_kmem_cache_t *skc, spl_kmem_magazine_t *skm, int flush)
 {
-	spin_lock(&skc->skc_lock);
+	spl_cache_lock(skc);
 	__spl_cache_flush(skc, skm, flush);
 	spin_unlock(&skc->skc_lock);
 }
 
+/*
+ * Exchange an empty per-cpu magazine for a full magazine from the depot.
+ * The full magazine is loaded as the cpu's magazine and returned, or NULL
+ * is returned when the depot contains no full magazines.  Must be called
+ * with interrupts disabled on the cpu which owns the magazine.
+ */
+static spl_kmem_magazine_t *
+spl_depot_alloc(spl_kmem_cache_t *skc, spl_kmem_magazine_t *skm)
+{
+	spl_kmem_magazine_t *full = NULL;
+
+	ASSERT(skm->skm_magic == SKM_MAGIC);
+	ASSERT(skm->skm_avail == 0);
+	ASSERT(irqs_disabled());
+
+	/* Unlocked check, avoid the depot lock when there is nothing */
+	if (skc->skc_depot_nfull == 0)
+		return (NULL);
+
+	spin_lock(&skc->skc_depot_lock);
+	if (!list_empty(&skc->skc_depot_full)) {
+		full = list_first_entry(&skc->skc_depot_full,
+		    spl_kmem_magazine_t, skm_list);
+		list_del_init(&full->skm_list);
+		skc->skc_depot_nfull--;
+		list_add(&skm->skm_list, &skc->skc_depot_empty);
+		skc->skc_depot_nempty++;
+		skc->skc_depot_alloc++;
+		skc->skc_depot_age = jiffies;
+	}
+	spin_unlock(&skc->skc_depot_lock);
+
+	if (full == NULL)
+		return (NULL);
+
+	ASSERT(full->skm_magic == SKM_MAGIC);
+	ASSERT(full->skm_avail > 0);
+	full->skm_size = skc->skc_mag_size;
+	full->skm_refill = skc->skc_mag_refill;
+	full->skm_cpu = skm->skm_cpu;
+	full->skm_age = jiffies;
+	skc->skc_mag[skm->skm_cpu] = full;
+
+	return (full);
+}
+
+/*
+ * Exchange a full per-cpu magazine for an empty magazine from the depot.
+ * When no empty magazine is available a new one is allocated without
+ * blocking.  The empty magazine is loaded as the cpu's magazine and
+ * returned, or NULL is returned when the depot is full or a magazine
+ * could not be allocated.  Must be called with interrupts disabled on
+ * the cpu which owns the magazine.
+ */
+static spl_kmem_magazine_t *
+spl_depot_free(spl_kmem_cache_t *skc, spl_kmem_magazine_t *skm)
+{
+	spl_kmem_magazine_t *empty = NULL;
+
+	ASSERT(skm->skm_magic == SKM_MAGIC);
+	ASSERT(irqs_disabled());
+
+	if (skc->skc_depot_nfull >= skc->skc_depot_max)
+		return (NULL);
+
+	spin_lock(&skc->skc_depot_lock);
+	if (!list_empty(&skc->skc_depot_empty)) {
+		empty = list_first_entry(&skc->skc_depot_empty,
+		    spl_kmem_magazine_t, skm_list);
+		list_del_init(&empty->skm_list);
+		skc->skc_depot_nempty--;
+		list_add(&skm->skm_list, &skc->skc_depot_full);
+		skc->skc_depot_nfull++;
+		skc->skc_depot_free++;
+		skc->skc_depot_age = jiffies;
+	}
+	spin_unlock(&skc->skc_depot_lock);
+
+	if (empty == NULL) {
+		empty = spl_magazine_alloc(skc, skm->skm_cpu,
+		    GFP_NOWAIT | __GFP_NOWARN);
+		if (empty == NULL)
+			return (NULL);
+
+		spin_lock(&skc->skc_depot_lock);
+		list_add(&skm->skm_list, &skc->skc_depot_full);
+		skc->skc_depot_nfull++;
+		skc->skc_depot_free++;
+		skc->skc_depot_age = jiffies;
+		spin_unlock(&skc->skc_depot_lock);
+	}
+
+	ASSERT(empty->skm_magic == SKM_MAGIC);
+	ASSERT(empty->skm_avail == 0);
+	empty->skm_size = skc->skc_mag_size;
+	empty->skm_refill = skc->skc_mag_refill;
+	empty->skm_cpu = skm->skm_cpu;
+	empty->skm_age = jiffies;
+	skc->skc_mag[skm->skm_cpu] = empty;
+
+	return (empty);
+}
+
+/*
+ * Release all objects held in the depot's full magazines back to their
+ * slabs and free every magazine held by the depot.
+ */
+static void
+spl_depot_reap(spl_kmem_cache_t *skc)
+{
+	spl_kmem_magazine_t *skm, *n;
+	unsigned long irq_flags;
+	LIST_HEAD(full);
+	LIST_HEAD(empty);
+
+	spin_lock_irqsave(&skc->skc_depot_lock, irq_flags);
+	list_splice_init(&skc->skc_depot_full, &full);
+	list_splice_init(&skc->skc_depot_empty, &empty);
+	skc->skc_depot_nfull = 0;
+	skc->skc_depot_nempty = 0;
+	spin_unlock_irqrestore(&skc->skc_depot_lock, irq_flags);
+
+	list_for_each_entry_safe(skm, n, &full, skm_list) {
+		list_del_init(&skm->skm_list);
+		spl_cache_flush(skc, skm, skm->skm_avail);
+		spl_magazine_free(skm);
+	}
+
+	list_for_each_entry_safe(skm, n, &empty, skm_list) {
+		list_del_init(&skm->skm_list);
+		spl_magazine_free(skm);
+	}
+}
+
 static void
 spl_magazine_age(void *data)
 {
@@ -630,83 +1110,395 @@ spl_magazine_age(void *data)
 }
 
 /*
- * Called regularly to keep a downward pressure on the cache.
- *
- * Objects older than skc->skc_delay seconds in the per-cpu magazines will
- * be returned to the caches.  This is done to prevent idle magazines from
- * holding memory which could be better used elsewhere.  The delay is
- * present to prevent thrashing the magazine.
+ * Constructed object magazines for caches backed by the Linux slab
  *
- * The newly released objects may result in empty partial slabs.  Those
- * slabs should be released to the system.  Otherwise moving the objects
- * out of the magazines is just wasted work.
+ * Objects in these magazines are kept in their constructed state, so
+ * unlike SPL slab backed caches they can't be flushed from interrupt
+ * context where the destructor may not be run.  Instead each non-empty
+ * magazine is exchanged for the cache's empty spare magazine on its cpu.
+ * The objects in the removed magazine are then destroyed and freed in
+ * process context, after which it becomes the new spare.  The spare is
+ * protected by the KMC_BIT_REAPING bit.
  */
 static void
-spl_cache_age(void *data)
+spl_slab_magazine_swap(void *data)
 {
 	spl_kmem_cache_t *skc = (spl_kmem_cache_t *)data;
-	taskqid_t id = 0;
-
-	ASSERT(skc->skc_magic == SKC_MAGIC);
+	spl_kmem_magazine_t *skm = skc->skc_mag[smp_processor_id()];
+	spl_kmem_magazine_t *spare = skc->skc_mag_spare;
 
-	/* Dynamically disabled at run time */
-	if (!(spl_kmem_cache_expire & KMC_EXPIRE_AGE))
-		return;
+	ASSERT(skm->skm_magic == SKM_MAGIC);
+	ASSERT(skm->skm_cpu == smp_processor_id());
+	ASSERT(spare->skm_avail == 0);
+	ASSERT(irqs_disabled());
 
-	atomic_inc(&skc->skc_ref);
+	spare->skm_cpu = skm->skm_cpu;
+	spare->skm_age = jiffies;
+	skc->skc_mag[skm->skm_cpu] = spare;
+	skc->skc_mag_spare = skm;
+}
 
-	if (!(skc->skc_flags & KMC_NOMAGAZINE))
-		on_each_cpu(spl_magazine_age, skc, 1);
+/*
+ * Destroy and free every object in a magazine which is not in use by
+ * any cpu.
+ */
+static void
+spl_slab_magazine_empty(spl_kmem_cache_t *skc, spl_kmem_magazine_t *skm)
+{
+	void *obj;
 
-	spl_slab_reclaim(skc);
+	while (skm->skm_avail > 0) {
+		obj = skm->skm_objs[--skm->skm_avail];
 
-	while (!test_bit(KMC_BIT_DESTROY, &skc->skc_flags) && !id) {
-		id = taskq_dispatch_delay(
-		    spl_kmem_cache_taskq, spl_cache_age, skc, TQ_SLEEP,
-		    ddi_get_lbolt() + skc->skc_delay / 3 * HZ);
+		if (skc->skc_dtor)
+			skc->skc_dtor(obj, skc->skc_private);
 
-		/* Destroy issued after dispatch immediately cancel it */
-		if (test_bit(KMC_BIT_DESTROY, &skc->skc_flags) && id)
-			taskq_cancel_id(spl_kmem_cache_taskq, id);
+		kmem_cache_free(skc->skc_linux_cache, obj);
 	}
-
-	spin_lock(&skc->skc_lock);
-	skc->skc_taskqid = id;
-	spin_unlock(&skc->skc_lock);
-
-	atomic_dec(&skc->skc_ref);
 }
 
 /*
- * Size a slab based on the size of each aligned object plus spl_kmem_obj_t.
- * When on-slab we want to target spl_kmem_cache_obj_per_slab.  However,
- * for very small objects we may end up with more than this so as not
- * to waste space in the minimal allocation of a single page.  Also for
- * very large objects we may use as few as spl_kmem_cache_obj_per_slab_min,
- * lower than this and we will fail.
+ * Release the constructed objects held in the per-cpu magazines back to
+ * the Linux slab.  When age is set only magazines which have not been
+ * accessed in skc->skc_delay seconds are drained.  The magazine pointers
+ * are only changed by this function, so they may be safely inspected
+ * from any cpu while the spare is held.
  */
-static int
-spl_slab_size(spl_kmem_cache_t *skc, uint32_t *objs, uint32_t *size)
+static void
+spl_slab_magazine_drain(spl_kmem_cache_t *skc, boolean_t age)
 {
-	uint32_t sks_size, obj_size, max_size, tgt_size, tgt_objs;
+	spl_kmem_magazine_t *skm;
+	int cpu;
 
-	if (skc->skc_flags & KMC_OFFSLAB) {
-		tgt_objs = spl_kmem_cache_obj_per_slab;
-		tgt_size = P2ROUNDUP(sizeof (spl_kmem_slab_t), PAGE_SIZE);
+	ASSERT(skc->skc_flags & KMC_SLAB);
+	ASSERT0(skc->skc_flags & KMC_NOMAGAZINE);
+	might_sleep();
 
-		if ((skc->skc_flags & KMC_KMEM) &&
-		    (spl_obj_size(skc) > (SPL_MAX_ORDER_NR_PAGES * PAGE_SIZE)))
-			return (-ENOSPC);
-	} else {
-		sks_size = spl_sks_size(skc);
-		obj_size = spl_obj_size(skc);
-		max_size = (spl_kmem_cache_max_size * 1024 * 1024);
-		tgt_size = (spl_kmem_cache_obj_per_slab * obj_size + sks_size);
+	for_each_possible_cpu(cpu) {
+		skm = skc->skc_mag[cpu];
 
-		/*
-		 * KMC_KMEM slabs are allocated by __get_free_pages() which
-		 * rounds up to the nearest order.  Knowing this the size
-		 * should be rounded up to the next power of two with a hard
+		if (ACCESS_ONCE(skm->skm_avail) == 0)
+			continue;
+
+		if (age && time_before(jiffies,
+		    ACCESS_ONCE(skm->skm_age) + skc->skc_delay * HZ))
+			continue;
+
+		/* Magazines of offline cpus are not in use */
+		if (smp_call_function_single(cpu,
+		    spl_slab_magazine_swap, skc, 1) != 0) {
+			spl_slab_magazine_empty(skc, skm);
+			continue;
+		}
+
+		spl_slab_magazine_empty(skc, skc->skc_mag_spare);
+		cond_resched();
+	}
+}
+
+/*
+ * Drain the magazines of a Linux slab backed cache unless they are
+ * already being drained.
+ */
+static void
+spl_slab_magazine_reap(spl_kmem_cache_t *skc, boolean_t age)
+{
+	if (test_and_set_bit(KMC_BIT_REAPING, &skc->skc_flags))
+		return;
+
+	spl_slab_magazine_drain(skc, age);
+
+	clear_bit_unlock(KMC_BIT_REAPING, &skc->skc_flags);
+	smp_mb__after_atomic();
+	wake_up_bit(&skc->skc_flags, KMC_BIT_REAPING);
+}
+
+/*
+ * Allocate a constructed object from the per-cpu magazine of a Linux slab
+ * backed cache, NULL is returned when the magazine is empty.
+ */
+static void *
+spl_slab_magazine_alloc(spl_kmem_cache_t *skc)
+{
+	spl_kmem_magazine_t *skm;
+	unsigned long irq_flags;
+	void *obj = NULL;
+
+	local_irq_save(irq_flags);
+	skm = skc->skc_mag[smp_processor_id()];
+	ASSERT(skm->skm_magic == SKM_MAGIC);
+
+	if (likely(skm->skm_avail)) {
+		obj = skm->skm_objs[--skm->skm_avail];
+		skm->skm_age = jiffies;
+	}
+	local_irq_restore(irq_flags);
+
+	return (obj);
+}
+
+/*
+ * Free a still constructed object to the per-cpu magazine of a Linux slab
+ * backed cache.  Returns B_FALSE when the magazine is full, the caller is
+ * then responsible for destroying and freeing the object.
+ */
+static boolean_t
+spl_slab_magazine_free(spl_kmem_cache_t *skc, void *obj)
+{
+	spl_kmem_magazine_t *skm;
+	unsigned long irq_flags;
+	boolean_t cached = B_FALSE;
+
+	local_irq_save(irq_flags);
+	skm = skc->skc_mag[smp_processor_id()];
+	ASSERT(skm->skm_magic == SKM_MAGIC);
+
+	if (likely(skm->skm_avail < skm->skm_size)) {
+		skm->skm_objs[skm->skm_avail++] = obj;
+		cached = B_TRUE;
+	}
+	local_irq_restore(irq_flags);
+
+	return (cached);
+}
+
+/*
+ * Called regularly to keep a downward pressure on the cache.
+ *
+ * Objects older than skc->skc_delay seconds in the per-cpu magazines will
+ * be returned to the caches.  This is done to prevent idle magazines from
+ * holding memory which could be better used elsewhere.  The delay is
+ * present to prevent thrashing the magazine.
+ *
+ * The newly released objects may result in empty partial slabs.  Those
+ * slabs should be released to the system.  Otherwise moving the objects
+ * out of the magazines is just wasted work.
+ */
+static void
+spl_cache_age(void *data)
+{
+	spl_kmem_cache_t *skc = (spl_kmem_cache_t *)data;
+	taskqid_t id = 0;
+
+	ASSERT(skc->skc_magic == SKC_MAGIC);
+
+	/* Dynamically disabled at run time */
+	if (!(spl_kmem_cache_expire & KMC_EXPIRE_AGE))
+		return;
+
+	atomic_inc(&skc->skc_ref);
+
+	if (skc->skc_flags & KMC_SLAB) {
+		if (!(skc->skc_flags & KMC_NOMAGAZINE))
+			spl_slab_magazine_reap(skc, B_TRUE);
+	} else {
+		on_each_cpu(spl_magazine_age, skc, 1);
+
+		/* Release the depot when no exchanges occurred recently */
+		if (time_after(jiffies,
+		    skc->skc_depot_age + skc->skc_delay * HZ))
+			spl_depot_reap(skc);
+
+		spl_slab_reclaim(skc);
+	}
+
+	while (!test_bit(KMC_BIT_DESTROY, &skc->skc_flags) && !id) {
+		id = taskq_dispatch_delay(
+		    spl_kmem_cache_taskq, spl_cache_age, skc, TQ_SLEEP,
+		    ddi_get_lbolt() + skc->skc_delay / 3 * HZ);
+
+		/* Destroy issued after dispatch immediately cancel it */
+		if (test_bit(KMC_BIT_DESTROY, &skc->skc_flags) && id)
+			taskq_cancel_id(spl_kmem_cache_taskq, id);
+	}
+
+	spin_lock(&skc->skc_lock);
+	skc->skc_taskqid = id;
+	spin_unlock(&skc->skc_lock);
+
+	atomic_dec(&skc->skc_ref);
+}
+
+/*
+ * Load the current magazine size for the cache in to the per-cpu magazine.
+ * When the magazine was shrunk any objects beyond the new size are released
+ * back to their slabs.  Like spl_magazine_age() this is skipped when the
+ * lock is contended, the excess objects will then be flushed by a later
+ * spl_kmem_cache_free().
+ */
+static void
+spl_magazine_resize_cpu(void *data)
+{
+	spl_kmem_cache_t *skc = (spl_kmem_cache_t *)data;
+	spl_kmem_magazine_t *skm = skc->skc_mag[smp_processor_id()];
+
+	ASSERT(skm->skm_magic == SKM_MAGIC);
+	ASSERT(skm->skm_cpu == smp_processor_id());
+	ASSERT(irqs_disabled());
+
+	skm->skm_size = skc->skc_mag_size;
+	skm->skm_refill = skc->skc_mag_refill;
+
+	if (skm->skm_avail <= skm->skm_size)
+		return;
+
+	if (!spin_trylock(&skc->skc_lock))
+		return;
+
+	__spl_cache_flush(skc, skm, skm->skm_avail - skm->skm_size);
+	spin_unlock(&skc->skc_lock);
+}
+
+/*
+ * Adjust the magazine size of a cache based on how it was used over the
+ * last interval, this is modeled after the Solaris magazine resizing.
+ * When the refill and flush paths repeatedly found the cache lock held
+ * the magazines are doubled so the slab lists are accessed less often.
+ * When no refills, flushes, or depot exchanges occurred for several
+ * intervals the cache is considered idle and the magazines are halved
+ * so they do not pin memory which could be better used elsewhere.  The
+ * size is always kept between skc_mag_min and skc_mag_max, the latter
+ * being the capacity every magazine was allocated with.
+ */
+static void
+spl_magazine_resize(spl_kmem_cache_t *skc)
+{
+	uint64_t contended, traffic;
+	uint32_t size;
+	boolean_t shrink;
+
+	ASSERT(skc->skc_magic == SKC_MAGIC);
+
+	if (skc->skc_flags & (KMC_NOMAGAZINE | KMC_SLAB))
+		return;
+
+	spin_lock(&skc->skc_lock);
+	contended = skc->skc_mag_contended;
+	traffic = skc->skc_mag_traffic;
+	skc->skc_mag_contended = 0;
+	skc->skc_mag_traffic = 0;
+	spin_unlock(&skc->skc_lock);
+
+	if (contended >= SPL_KMEM_MAGAZINE_CONTENTION) {
+		skc->skc_mag_idle = 0;
+		size = MIN(skc->skc_mag_size * 2, skc->skc_mag_max);
+	} else if (traffic == 0 && time_after(jiffies,
+	    skc->skc_depot_age + SPL_KMEM_CACHE_DELAY * HZ)) {
+		if (++skc->skc_mag_idle < SPL_KMEM_MAGAZINE_IDLE)
+			return;
+
+		skc->skc_mag_idle = 0;
+		size = MAX(skc->skc_mag_size / 2, skc->skc_mag_min);
+	} else {
+		skc->skc_mag_idle = 0;
+		return;
+	}
+
+	if (size == skc->skc_mag_size)
+		return;
+
+	shrink = (size < skc->skc_mag_size);
+
+	spin_lock(&skc->skc_lock);
+	skc->skc_mag_size = size;
+	skc->skc_mag_refill = (size + 1) / 2;
+	skc->skc_grow_lowat = skc->skc_mag_refill;
+	skc->skc_mag_resize++;
+	spin_unlock(&skc->skc_lock);
+
+	on_each_cpu(spl_magazine_resize_cpu, skc, 1);
+
+	/* Full depot magazines may exceed the new size, release them */
+	if (shrink) {
+		spl_depot_reap(skc);
+		spl_slab_reclaim(skc);
+	}
+}
+
+/*
+ * Called regularly to resize the magazines of all registered caches.
+ */
+static DEFINE_SPINLOCK(spl_kmem_cache_update_lock);
+static taskqid_t spl_kmem_cache_update_id = TASKQID_INVALID;
+static boolean_t spl_kmem_cache_update_stop = B_FALSE;
+
+static void
+spl_kmem_cache_update(void *data)
+{
+	spl_kmem_cache_t *skc;
+	taskqid_t id = TASKQID_INVALID;
+
+	if (spl_kmem_cache_magazine_resize) {
+		down_read(&spl_kmem_cache_sem);
+		list_for_each_entry(skc, &spl_kmem_cache_list, skc_list)
+			spl_magazine_resize(skc);
+		up_read(&spl_kmem_cache_sem);
+	}
+
+	while (!ACCESS_ONCE(spl_kmem_cache_update_stop) && !id) {
+		id = taskq_dispatch_delay(spl_kmem_cache_taskq,
+		    spl_kmem_cache_update, NULL, TQ_SLEEP,
+		    ddi_get_lbolt() + SPL_KMEM_CACHE_DELAY * HZ);
+
+		/* Shutdown issued after dispatch immediately cancel it */
+		if (ACCESS_ONCE(spl_kmem_cache_update_stop) && id)
+			taskq_cancel_id(spl_kmem_cache_taskq, id);
+	}
+
+	spin_lock(&spl_kmem_cache_update_lock);
+	spl_kmem_cache_update_id = id;
+	spin_unlock(&spl_kmem_cache_update_lock);
+}
+
+/*
+ * The largest color which may be used for an on-slab slab.  This is the
+ * space left over after the spl_kmem_slab_t and objects, rounded down to
+ * a multiple of the color step.  Off-slab slabs are not colored.
+ */
+static uint32_t
+spl_slab_color_max(spl_kmem_cache_t *skc)
+{
+	uint32_t used;
+
+	if (skc->skc_flags & KMC_OFFSLAB)
+		return (0);
+
+	used = spl_sks_size(skc) + skc->skc_slab_objs * spl_obj_size(skc);
+	ASSERT3U(used, <=, skc->skc_slab_size);
+
+	return (P2ALIGN(skc->skc_slab_size - used, spl_slab_color_step(skc)));
+}
+
+/*
+ * Size a slab based on the size of each aligned object plus spl_kmem_obj_t.
+ * When on-slab we want to target spl_kmem_cache_obj_per_slab.  However,
+ * for very small objects we may end up with more than this so as not
+ * to waste space in the minimal allocation of a single page.  Also for
+ * very large objects we may use as few as spl_kmem_cache_obj_per_slab_min,
+ * lower than this and we will fail.
+ */
+static int
+spl_slab_size(spl_kmem_cache_t *skc, uint32_t *objs, uint32_t *size)
+{
+	uint32_t sks_size, obj_size, max_size, tgt_size, tgt_objs;
+
+	if (skc->skc_flags & KMC_OFFSLAB) {
+		tgt_objs = spl_kmem_cache_obj_per_slab;
+		tgt_size = P2ROUNDUP(sizeof (spl_kmem_slab_t), PAGE_SIZE);
+
+		if ((skc->skc_flags & KMC_KMEM) &&
+		    (spl_obj_size(skc) > (SPL_MAX_ORDER_NR_PAGES * PAGE_SIZE)))
+			return (-ENOSPC);
+	} else {
+		sks_size = spl_sks_size(skc);
+		obj_size = spl_obj_size(skc);
+		max_size = (spl_kmem_cache_max_size * 1024 * 1024);
+		tgt_size = (spl_kmem_cache_obj_per_slab * obj_size + sks_size);
+
+		/*
+		 * KMC_KMEM slabs are allocated by __get_free_pages() which
+		 * rounds up to the nearest order.  Knowing this the size
+		 * should be rounded up to the next power of two with a hard
 		 * maximum defined by the maximum allowed allocation order.
 		 */
 		if (skc->skc_flags & KMC_KMEM) {
@@ -721,6 +1513,14 @@ spl_slab_size(spl_kmem_cache_t *skc, uint32_t *objs, uint32_t *size)
 			tgt_objs = (max_size - sks_size) / obj_size;
 			tgt_size = (tgt_objs * obj_size) + sks_size;
 		}
+
+		/*
+		 * KMC_VMEM slabs are backed by whole pages regardless of the
+		 * requested size.  Round up so the remainder of the last page
+		 * may be used to color the slab.
+		 */
+		if (skc->skc_flags & KMC_VMEM)
+			tgt_size = P2ROUNDUP(tgt_size, PAGE_SIZE);
 	}
 
 	if (tgt_objs == 0)
@@ -733,9 +1533,9 @@ spl_slab_size(spl_kmem_cache_t *skc, uint32_t *objs, uint32_t *size)
 }
 
 /*
- * Make a guess at reasonable per-cpu magazine size based on the size of
- * each object and the cost of caching N of them in each magazine.  Long
- * term this should really adapt based on an observed usage heuristic.
+ * Make a guess at reasonable initial per-cpu magazine size based on the
+ * size of each object and the cost of caching N of them in each magazine.
+ * The size is then adapted to the observed usage by spl_magazine_resize().
  */
 static int
 spl_magazine_size(spl_kmem_cache_t *skc)
@@ -744,7 +1544,8 @@ spl_magazine_size(spl_kmem_cache_t *skc)
 	int size;
 
 	if (spl_kmem_cache_magazine_size > 0)
-		return (MAX(MIN(spl_kmem_cache_magazine_size, 256), 2));
+		return (MAX(MIN(spl_kmem_cache_magazine_size,
+		    SPL_KMEM_MAGAZINE_MAX), SPL_KMEM_MAGAZINE_MIN));
 
 	/* Per-magazine sizes below assume a 4Kib page size */
 	if (obj_size > (PAGE_SIZE * 256))
@@ -762,22 +1563,24 @@ spl_magazine_size(spl_kmem_cache_t *skc)
 }
 
 /*
- * Allocate a per-cpu magazine to associate with a specific core.
+ * Allocate a per-cpu magazine to associate with a specific core.  Space
+ * is reserved for the maximum magazine size so it may be resized in place.
  */
 static spl_kmem_magazine_t *
-spl_magazine_alloc(spl_kmem_cache_t *skc, int cpu)
+spl_magazine_alloc(spl_kmem_cache_t *skc, int cpu, gfp_t lflags)
 {
 	spl_kmem_magazine_t *skm;
 	int size = sizeof (spl_kmem_magazine_t) +
-	    sizeof (void *) * skc->skc_mag_size;
+	    sizeof (void *) * skc->skc_mag_max;
 
-	skm = kmalloc_node(size, GFP_KERNEL, cpu_to_node(cpu));
+	skm = kmalloc_node(size, lflags, cpu_to_node(cpu));
 	if (skm) {
 		skm->skm_magic = SKM_MAGIC;
 		skm->skm_avail = 0;
 		skm->skm_size = skc->skc_mag_size;
 		skm->skm_refill = skc->skc_mag_refill;
 		skm->skm_cache = skc;
+		INIT_LIST_HEAD(&skm->skm_list);
 		skm->skm_age = jiffies;
 		skm->skm_cpu = cpu;
 	}
@@ -793,6 +1596,7 @@ spl_magazine_free(spl_kmem_magazine_t *skm)
 {
 	ASSERT(skm->skm_magic == SKM_MAGIC);
 	ASSERT(skm->skm_avail == 0);
+	ASSERT(list_empty(&skm->skm_list));
 	kfree(skm);
 }
 
@@ -811,9 +1615,17 @@ spl_magazine_create(spl_kmem_cache_t *skc)
 	    num_possible_cpus(), kmem_flags_convert(KM_SLEEP));
 	skc->skc_mag_size = spl_magazine_size(skc);
 	skc->skc_mag_refill = (skc->skc_mag_size + 1) / 2;
+	skc->skc_grow_lowat = skc->skc_mag_refill;
+	skc->skc_mag_min = SPL_KMEM_MAGAZINE_MIN;
+	skc->skc_mag_max = spl_kmem_cache_magazine_size ? skc->skc_mag_size :
+	    MIN(skc->skc_mag_size * 4, SPL_KMEM_MAGAZINE_MAX);
+	skc->skc_mag_idle = 0;
+	skc->skc_depot_max = spl_kmem_cache_depot_size ?
+	    spl_kmem_cache_depot_size : num_possible_cpus();
+	skc->skc_depot_age = jiffies;
 
 	for_each_possible_cpu(i) {
-		skc->skc_mag[i] = spl_magazine_alloc(skc, i);
+		skc->skc_mag[i] = spl_magazine_alloc(skc, i, GFP_KERNEL);
 		if (!skc->skc_mag[i]) {
 			for (i--; i >= 0; i--)
 				spl_magazine_free(skc->skc_mag[i]);
@@ -823,11 +1635,23 @@ spl_magazine_create(spl_kmem_cache_t *skc)
 		}
 	}
 
+	/* Magazines of constructed objects are drained using a spare */
+	if (skc->skc_flags & KMC_SLAB) {
+		skc->skc_mag_spare = spl_magazine_alloc(skc, 0, GFP_KERNEL);
+		if (skc->skc_mag_spare == NULL) {
+			for_each_possible_cpu(i)
+				spl_magazine_free(skc->skc_mag[i]);
+
+			kfree(skc->skc_mag);
+			return (-ENOMEM);
+		}
+	}
+
 	return (0);
 }
 
 /*
- * Destroy all pre-cpu magazines.
+ * Destroy all pre-cpu magazines and the magazines held by the depot.
  */
 static void
 spl_magazine_destroy(spl_kmem_cache_t *skc)
@@ -838,6 +1662,19 @@ spl_magazine_destroy(spl_kmem_cache_t *skc)
 	if (skc->skc_flags & KMC_NOMAGAZINE)
 		return;
 
+	if (skc->skc_flags & KMC_SLAB) {
+		spl_slab_magazine_drain(skc, B_FALSE);
+
+		for_each_possible_cpu(i)
+			spl_magazine_free(skc->skc_mag[i]);
+
+		spl_magazine_free(skc->skc_mag_spare);
+		kfree(skc->skc_mag);
+		return;
+	}
+
+	spl_depot_reap(skc);
+
 	for_each_possible_cpu(i) {
 		skm = skc->skc_mag[i];
 		spl_cache_flush(skc, skm, skm->skm_avail);
@@ -847,6 +1684,37 @@ spl_magazine_destroy(spl_kmem_cache_t *skc)
 	kfree(skc->skc_mag);
 }
 
+/*
+ * Create the per-node slab lists, an entry exists for every possible node.
+ * Each node also carries its own growth request so slabs can be allocated
+ * for a node in advance without an additional allocation.
+ */
+static int
+spl_node_create(spl_kmem_cache_t *skc)
+{
+	spl_kmem_node_t *skn;
+	int i;
+
+	skc->skc_node = kzalloc(sizeof (spl_kmem_node_t) * nr_node_ids,
+	    kmem_flags_convert(KM_SLEEP));
+	if (skc->skc_node == NULL)
+		return (-ENOMEM);
+
+	for (i = 0; i < nr_node_ids; i++) {
+		skn = &skc->skc_node[i];
+		INIT_LIST_HEAD(&skn->skn_complete_list);
+		INIT_LIST_HEAD(&skn->skn_partial_list);
+		skn->skn_grow.ska_cache = skc;
+		skn->skn_grow.ska_flags = KM_SLEEP;
+		skn->skn_grow.ska_node = i;
+		skn->skn_grow.ska_count = 0;
+		taskq_init_ent(&skn->skn_grow.ska_tqe);
+		skn->skn_growing = B_FALSE;
+	}
+
+	return (0);
+}
+
 /*
  * Create a object cache based on the following arguments:
  * name		cache name
@@ -903,6 +1771,7 @@ spl_kmem_cache_create(char *name, size_t size, size_t align,
 	skc->skc_ctor = ctor;
 	skc->skc_dtor = dtor;
 	skc->skc_reclaim = reclaim;
+	skc->skc_move = NULL;
 	skc->skc_private = priv;
 	skc->skc_vmp = vmp;
 	skc->skc_linux_cache = NULL;
@@ -914,9 +1783,13 @@ spl_kmem_cache_create(char *name, size_t size, size_t align,
 	atomic_set(&skc->skc_ref, 0);
 
 	INIT_LIST_HEAD(&skc->skc_list);
-	INIT_LIST_HEAD(&skc->skc_complete_list);
-	INIT_LIST_HEAD(&skc->skc_partial_list);
-	skc->skc_emergency_tree = RB_ROOT;
+	skc->skc_node = NULL;
+	INIT_LIST_HEAD(&skc->skc_depot_full);
+	INIT_LIST_HEAD(&skc->skc_depot_empty);
+	skc->skc_depot_nfull = 0;
+	skc->skc_depot_nempty = 0;
+	skc->skc_depot_max = 0;
+	spin_lock_init(&skc->skc_depot_lock);
 	spin_lock_init(&skc->skc_lock);
 	init_waitqueue_head(&skc->skc_waitq);
 	skc->skc_slab_fail = 0;
@@ -931,6 +1804,20 @@ spl_kmem_cache_create(char *name, size_t size, size_t align,
 	skc->skc_obj_deadlock = 0;
 	skc->skc_obj_emergency = 0;
 	skc->skc_obj_emergency_max = 0;
+	skc->skc_depot_alloc = 0;
+	skc->skc_depot_free = 0;
+	skc->skc_move_attempt = 0;
+	skc->skc_move_yes = 0;
+	skc->skc_move_later = 0;
+	skc->skc_slab_defrag = 0;
+	skc->skc_mag_contended = 0;
+	skc->skc_mag_traffic = 0;
+	skc->skc_mag_resize = 0;
+	skc->skc_grow_lowat = 0;
+	skc->skc_grow_batch = 0;
+	skc->skc_grow_slabs = 0;
+	memset(skc->skc_grow_wait, 0, sizeof (skc->skc_grow_wait));
+	skc->skc_defrag_taskqid = TASKQID_INVALID;
 
 	/*
 	 * Verify the requested alignment restriction is sane.
@@ -983,6 +1870,13 @@ spl_kmem_cache_create(char *name, size_t size, size_t align,
 		if (rc)
 			goto out;
 
+		skc->skc_slab_color = 0;
+		skc->skc_slab_color_max = spl_slab_color_max(skc);
+
+		rc = spl_node_create(skc);
+		if (rc)
+			goto out;
+
 		rc = spl_magazine_create(skc);
 		if (rc)
 			goto out;
@@ -1023,7 +1917,20 @@ spl_kmem_cache_create(char *name, size_t size, size_t align,
 #elif defined(HAVE_KMEM_CACHE_GFPFLAGS)
 		skc->skc_linux_cache->gfpflags |= __GFP_COMP;
 #endif
-		skc->skc_flags |= KMC_NOMAGAZINE;
+		/*
+		 * Magazines are only worthwhile when they allow the
+		 * constructor and destructor calls to be avoided.
+		 */
+		if (spl_kmem_cache_slab_magazine &&
+		    (skc->skc_ctor || skc->skc_dtor)) {
+			rc = spl_magazine_create(skc);
+			if (rc) {
+				kmem_cache_destroy(skc->skc_linux_cache);
+				goto out;
+			}
+		} else {
+			skc->skc_flags |= KMC_NOMAGAZINE;
+		}
 	}
 
 	if (spl_kmem_cache_expire & KMC_EXPIRE_AGE)
@@ -1037,6 +1944,7 @@ spl_kmem_cache_create(char *name, size_t size, size_t align,
 
 	return (skc);
 out:
+	kfree(skc->skc_node);
 	kfree(skc->skc_name);
 	kfree(skc);
 	return (NULL);
@@ -1044,14 +1952,34 @@ out:
 EXPORT_SYMBOL(spl_kmem_cache_create);
 
 /*
- * Register a move callback for cache defragmentation.
- * XXX: Unimplemented but harmless to stub out for now.
+ * Register a move callback for cache defragmentation.  Caches backed by
+ * the Linux slab, or which place their objects off slab, are never
+ * consolidated and the callback is recorded but otherwise unused.
  */
 void
 spl_kmem_cache_set_move(spl_kmem_cache_t *skc,
     kmem_cbrc_t (move)(void *, void *, size_t, void *))
 {
+	taskqid_t id = TASKQID_INVALID;
+	boolean_t dispatch;
+
+	ASSERT(skc->skc_magic == SKC_MAGIC);
 	ASSERT(move != NULL);
+
+	spin_lock(&skc->skc_lock);
+	dispatch = (skc->skc_move == NULL);
+	skc->skc_move = move;
+	spin_unlock(&skc->skc_lock);
+
+	if (!dispatch || (skc->skc_flags & (KMC_SLAB | KMC_OFFSLAB)))
+		return;
+
+	id = taskq_dispatch_delay(spl_kmem_cache_taskq, spl_cache_defrag,
+	    skc, TQ_SLEEP, ddi_get_lbolt() + skc->skc_delay * HZ);
+
+	spin_lock(&skc->skc_lock);
+	skc->skc_defrag_taskqid = id;
+	spin_unlock(&skc->skc_lock);
 }
 EXPORT_SYMBOL(spl_kmem_cache_set_move);
 
@@ -1062,7 +1990,8 @@ void
 spl_kmem_cache_destroy(spl_kmem_cache_t *skc)
 {
 	DECLARE_WAIT_QUEUE_HEAD(wq);
-	taskqid_t id;
+	taskqid_t id, defrag_id;
+	int i;
 
 	ASSERT(skc->skc_magic == SKC_MAGIC);
 	ASSERT(skc->skc_flags & (KMC_KMEM | KMC_VMEM | KMC_SLAB));
@@ -1076,9 +2005,29 @@ spl_kmem_cache_destroy(spl_kmem_cache_t *skc)
 
 	spin_lock(&skc->skc_lock);
 	id = skc->skc_taskqid;
+	defrag_id = skc->skc_defrag_taskqid;
 	spin_unlock(&skc->skc_lock);
 
 	taskq_cancel_id(spl_kmem_cache_taskq, id);
+	taskq_cancel_id(spl_kmem_cache_taskq, defrag_id);
+
+	/*
+	 * Growth requests already dispatched hold a reference on the cache.
+	 * No new requests are made once KMC_BIT_DESTROY is set, so wait for
+	 * this cache's outstanding ones to finish their current slab and
+	 * exit.  Requests for other caches on the shared taskq are not
+	 * waited on.
+	 */
+	for (i = 0; skc->skc_node != NULL && i < nr_node_ids; i++) {
+		spin_lock(&skc->skc_lock);
+		id = skc->skc_node[i].skn_growing ?
+		    skc->skc_node[i].skn_grow.ska_tqe.tqent_id :
+		    TASKQID_INVALID;
+		spin_unlock(&skc->skc_lock);
+
+		if (id != TASKQID_INVALID)
+			taskq_wait_id(spl_kmem_cache_grow_taskq, id);
+	}
 
 	/*
 	 * Wait until all current callers complete, this is mainly
@@ -1092,6 +2041,7 @@ spl_kmem_cache_destroy(spl_kmem_cache_t *skc)
 		spl_slab_reclaim(skc);
 	} else {
 		ASSERT(skc->skc_flags & KMC_SLAB);
+		spl_magazine_destroy(skc);
 		kmem_cache_destroy(skc->skc_linux_cache);
 	}
 
@@ -1106,10 +2056,19 @@ spl_kmem_cache_destroy(spl_kmem_cache_t *skc)
 	ASSERT3U(skc->skc_slab_total, ==, 0);
 	ASSERT3U(skc->skc_obj_total, ==, 0);
 	ASSERT3U(skc->skc_obj_emergency, ==, 0);
-	ASSERT(list_empty(&skc->skc_complete_list));
+
+	if (skc->skc_node != NULL) {
+		int node;
+
+		for_each_node(node) {
+			ASSERT(list_empty(
+			    &skc->skc_node[node].skn_complete_list));
+		}
+	}
 
 	spin_unlock(&skc->skc_lock);
 
+	kfree(skc->skc_node);
 	kfree(skc->skc_name);
 	kfree(skc);
 }
@@ -1122,6 +2081,7 @@ EXPORT_SYMBOL(spl_kmem_cache_destroy);
 static void *
 spl_cache_obj(spl_kmem_cache_t *skc, spl_kmem_slab_t *sks)
 {
+	spl_kmem_node_t *skn = spl_slab_node(skc, sks);
 	spl_kmem_obj_t *sko;
 
 	ASSERT(skc->skc_magic == SKC_MAGIC);
@@ -1137,6 +2097,7 @@ spl_cache_obj(spl_kmem_cache_t *skc, spl_kmem_slab_t *sks)
 	sks->sks_age = jiffies;
 	sks->sks_ref++;
 	skc->skc_obj_alloc++;
+	skn->skn_obj_alloc++;
 
 	/* Track max obj usage statistics */
 	if (skc->skc_obj_alloc > skc->skc_obj_max)
@@ -1145,6 +2106,7 @@ spl_cache_obj(spl_kmem_cache_t *skc, spl_kmem_slab_t *sks)
 	/* Track max slab usage statistics */
 	if (sks->sks_ref == 1) {
 		skc->skc_slab_alloc++;
+		skn->skn_slab_alloc++;
 
 		if (skc->skc_slab_alloc > skc->skc_slab_max)
 			skc->skc_slab_max = skc->skc_slab_alloc;
@@ -1159,19 +2121,23 @@ spl_cache_obj(spl_kmem_cache_t *skc, spl_kmem_slab_t *sks)
  * of partial slabs, and then waking any waiters.
  */
 static int
-__spl_cache_grow(spl_kmem_cache_t *skc, int flags)
+__spl_cache_grow(spl_kmem_cache_t *skc, int flags, int node)
 {
 	spl_kmem_slab_t *sks;
+	spl_kmem_node_t *skn;
 
 	fstrans_cookie_t cookie = spl_fstrans_mark();
-	sks = spl_slab_alloc(skc, flags);
+	sks = spl_slab_alloc(skc, flags, node);
 	spl_fstrans_unmark(cookie);
 
 	spin_lock(&skc->skc_lock);
 	if (sks) {
+		skn = spl_slab_node(skc, sks);
 		skc->skc_slab_total++;
 		skc->skc_obj_total += sks->sks_objs;
-		list_add_tail(&sks->sks_list, &skc->skc_partial_list);
+		skn->skn_slab_total++;
+		skn->skn_obj_total += sks->sks_objs;
+		list_add_tail(&sks->sks_list, &skn->skn_partial_list);
 
 		smp_mb__before_atomic();
 		clear_bit(KMC_BIT_DEADLOCKED, &skc->skc_flags);
@@ -1183,13 +2149,87 @@ __spl_cache_grow(spl_kmem_cache_t *skc, int flags)
 	return (sks == NULL ? -ENOMEM : 0);
 }
 
+/*
+ * Check whether the free objects on the passed node have fallen below the
+ * cache's low watermark, and if so dispatch the node's growth request to
+ * allocate enough new slabs to restore twice the watermark.  The per-cpu
+ * watermark is limited to a single slab so caches with large objects or
+ * nodes with many cpus do not pin an excessive amount of memory.  At most
+ * spl_kmem_cache_grow_batch slabs are allocated in a single batch, and
+ * only one batch may be pending per node.  Must be called with the
+ * 'skc->skc_lock' held, and by a caller which holds a reference on the
+ * cache or is allocating from it.
+ */
+static void
+spl_cache_grow_check(spl_kmem_cache_t *skc, int node)
+{
+	spl_kmem_node_t *skn = &skc->skc_node[node];
+	unsigned long lowat, avail;
+	int count;
+
+	if (spl_kmem_cache_grow_batch == 0 || skn->skn_growing)
+		return;
+
+	if (!node_online(node) || test_bit(KMC_BIT_DESTROY, &skc->skc_flags))
+		return;
+
+	lowat = MIN(skc->skc_grow_lowat, skc->skc_slab_objs) *
+	    MAX(nr_cpus_node(node), 1);
+	avail = (unsigned long)(skn->skn_obj_total - skn->skn_obj_alloc);
+	if (avail >= lowat)
+		return;
+
+	count = DIV_ROUND_UP(2 * lowat - avail, skc->skc_slab_objs);
+	count = MIN(count, spl_kmem_cache_grow_batch);
+
+	skn->skn_growing = B_TRUE;
+	skn->skn_grow.ska_count = count;
+	atomic_inc(&skc->skc_ref);
+	taskq_dispatch_ent(spl_kmem_cache_grow_taskq, spl_cache_grow_batch,
+	    &skn->skn_grow, 0, &skn->skn_grow.ska_tqe);
+}
+
+/*
+ * Allocate a batch of new slabs on the requested node.  The batch is cut
+ * short when the cache is being destroyed or a slab cannot be allocated,
+ * the next allocation to drop below the watermark will try again.
+ */
+static void
+spl_cache_grow_batch(void *data)
+{
+	spl_kmem_alloc_t *ska = (spl_kmem_alloc_t *)data;
+	spl_kmem_cache_t *skc = ska->ska_cache;
+	int i;
+
+	for (i = 0; i < ska->ska_count; i++) {
+		if (test_bit(KMC_BIT_DESTROY, &skc->skc_flags))
+			break;
+
+		if (__spl_cache_grow(skc, ska->ska_flags, ska->ska_node))
+			break;
+	}
+
+	spin_lock(&skc->skc_lock);
+	skc->skc_grow_batch++;
+	skc->skc_grow_slabs += i;
+	skc->skc_node[ska->ska_node].skn_growing = B_FALSE;
+	spin_unlock(&skc->skc_lock);
+
+	atomic_dec(&skc->skc_ref);
+}
+
 static void
 spl_cache_grow_work(void *data)
 {
 	spl_kmem_alloc_t *ska = (spl_kmem_alloc_t *)data;
 	spl_kmem_cache_t *skc = ska->ska_cache;
 
-	(void) __spl_cache_grow(skc, ska->ska_flags);
+	(void) __spl_cache_grow(skc, ska->ska_flags, ska->ska_node);
+
+	/* Grow the node in advance when further allocations are likely */
+	spin_lock(&skc->skc_lock);
+	spl_cache_grow_check(skc, ska->ska_node);
+	spin_unlock(&skc->skc_lock);
 
 	atomic_dec(&skc->skc_ref);
 	smp_mb__before_atomic();
@@ -1199,6 +2239,24 @@ spl_cache_grow_work(void *data)
 	kfree(ska);
 }
 
+/*
+ * Account for the time an allocation was blocked waiting on a new slab.
+ * Bucket N of the histogram counts waits shorter than 2^N microseconds,
+ * the last bucket counts all longer waits.
+ */
+static void
+spl_cache_grow_hist(spl_kmem_cache_t *skc, hrtime_t delta)
+{
+	int bucket;
+
+	bucket = highbit64(NSEC2USEC(delta));
+	bucket = MIN(bucket, SPL_KMEM_CACHE_GROW_HIST - 1);
+
+	spin_lock(&skc->skc_lock);
+	skc->skc_grow_wait[bucket]++;
+	spin_unlock(&skc->skc_lock);
+}
+
 /*
  * Returns non-zero when a new slab should be available.
  */
@@ -1244,7 +2302,7 @@ spl_cache_grow(spl_kmem_cache_t *skc, int flags, void **obj)
 	 * __vmalloc() doesn't honor gfp flags in page table allocation.
 	 */
 	if (!(skc->skc_flags & KMC_VMEM)) {
-		rc = __spl_cache_grow(skc, flags | KM_NOSLEEP);
+		rc = __spl_cache_grow(skc, flags | KM_NOSLEEP, numa_node_id());
 		if (rc == 0)
 			return (0);
 	}
@@ -1269,8 +2327,10 @@ spl_cache_grow(spl_kmem_cache_t *skc, int flags, void **obj)
 		atomic_inc(&skc->skc_ref);
 		ska->ska_cache = skc;
 		ska->ska_flags = flags;
+		ska->ska_node = numa_node_id();
+		ska->ska_count = 1;
 		taskq_init_ent(&ska->ska_tqe);
-		taskq_dispatch_ent(spl_kmem_cache_taskq,
+		taskq_dispatch_ent(spl_kmem_cache_grow_taskq,
 		    spl_cache_grow_work, ska, 0, &ska->ska_tqe);
 	}
 
@@ -1286,8 +2346,11 @@ spl_cache_grow(spl_kmem_cache_t *skc, int flags, void **obj)
 	if (test_bit(KMC_BIT_DEADLOCKED, &skc->skc_flags)) {
 		rc = spl_emergency_alloc(skc, flags, obj);
 	} else {
+		hrtime_t start = gethrtime();
+
 		remaining = wait_event_timeout(skc->skc_waitq,
 		    spl_cache_grow_wait(skc), HZ / 10);
+		spl_cache_grow_hist(skc, gethrtime() - start);
 
 		if (!remaining) {
 			spin_lock(&skc->skc_lock);
@@ -1304,129 +2367,468 @@ spl_cache_grow(spl_kmem_cache_t *skc, int flags, void **obj)
 	return (rc);
 }
 
+/*
+ * Allocate up to count objects from the partial slabs in to the passed
+ * array on behalf of a cpu on the given node.  Partial slabs on the local
+ * node are used first, followed by those on remote nodes.  Returns the
+ * number of objects allocated which will be less than requested when no
+ * partial slabs remain, new slabs are never created here.  However, when
+ * the free objects on the node run low its batched growth is started.
+ * Must be called with the 'skc->skc_lock' held.
+ */
+static int
+__spl_cache_obj_bulk(spl_kmem_cache_t *skc, int node, void **objs, int count)
+{
+	spl_kmem_slab_t *sks;
+	spl_kmem_node_t *skn;
+	int i = 0;
+
+	while (i < count && (skn = spl_cache_node(skc, node)) != NULL) {
+		/* Grab the next available slab */
+		sks = list_entry(skn->skn_partial_list.next,
+		    spl_kmem_slab_t, sks_list);
+		ASSERT(sks->sks_magic == SKS_MAGIC);
+		ASSERT(sks->sks_ref < sks->sks_objs);
+		ASSERT(!list_empty(&sks->sks_free_list));
+
+		/*
+		 * Consume as many objects as needed to fill the array.  We
+		 * must also be careful not to overfill it.
+		 */
+		while (sks->sks_ref < sks->sks_objs && i < count) {
+			objs[i++] = spl_cache_obj(skc, sks);
+
+			if (sks->sks_node == node)
+				skn->skn_obj_local++;
+			else
+				skn->skn_obj_remote++;
+		}
+
+		/* Move slab to the node's complete list when full */
+		if (sks->sks_ref == sks->sks_objs) {
+			list_del(&sks->sks_list);
+			list_add(&sks->sks_list, &skn->skn_complete_list);
+		}
+	}
+
+	spl_cache_grow_check(skc, node);
+
+	return (i);
+}
+
 /*
  * Refill a per-cpu magazine with objects from the slabs for this cache.
  * Ideally the magazine can be repopulated using existing objects which have
  * been released, however if we are unable to locate enough free objects new
- * slabs of objects will be created.  On success NULL is returned, otherwise
- * the address of a single emergency object is returned for use by the caller.
+ * slabs of objects will be created.  Partial slabs on the cpu's local node
+ * are used first, followed by those on remote nodes, before growing the
+ * cache.  On success NULL is returned, otherwise the address of a single
+ * emergency object is returned for use by the caller.
  */
 static void *
 spl_cache_refill(spl_kmem_cache_t *skc, spl_kmem_magazine_t *skm, int flags)
 {
-	spl_kmem_slab_t *sks;
-	int count = 0, rc, refill;
+	int count, rc, refill, node = cpu_to_node(skm->skm_cpu);
 	void *obj = NULL;
 
 	ASSERT(skc->skc_magic == SKC_MAGIC);
 	ASSERT(skm->skm_magic == SKM_MAGIC);
 
 	refill = MIN(skm->skm_refill, skm->skm_size - skm->skm_avail);
-	spin_lock(&skc->skc_lock);
+	spl_cache_lock(skc);
 
 	while (refill > 0) {
+		count = __spl_cache_obj_bulk(skc, node,
+		    &skm->skm_objs[skm->skm_avail], refill);
+		skm->skm_avail += count;
+		refill -= count;
+		ASSERT3U(skm->skm_avail, <=, skm->skm_size);
+
+		if (refill == 0)
+			break;
+
 		/* No slabs available we may need to grow the cache */
-		if (list_empty(&skc->skc_partial_list)) {
+		spin_unlock(&skc->skc_lock);
+
+		local_irq_enable();
+		rc = spl_cache_grow(skc, flags, &obj);
+		local_irq_disable();
+
+		/* Emergency object for immediate use by caller */
+		if (rc == 0 && obj != NULL)
+			return (obj);
+
+		if (rc)
+			goto out;
+
+		/* Rescheduled to different CPU skm is not local */
+		if (skm != skc->skc_mag[smp_processor_id()])
+			goto out;
+
+		/*
+		 * Potentially rescheduled to the same CPU but allocations
+		 * may have occurred from this CPU while we were sleeping so
+		 * recalculate max refill.  The magazine may also have been
+		 * resized below the number of available objects.
+		 */
+		if (skm->skm_avail >= skm->skm_size)
+			goto out;
+
+		refill = MIN(refill, skm->skm_size - skm->skm_avail);
+
+		spin_lock(&skc->skc_lock);
+	}
+
+	spin_unlock(&skc->skc_lock);
+out:
+	return (NULL);
+}
+
+/*
+ * Release an object back to the slab from which it came.
+ */
+static void
+spl_cache_shrink(spl_kmem_cache_t *skc, void *obj)
+{
+	spl_kmem_slab_t *sks = NULL;
+	spl_kmem_obj_t *sko = NULL;
+	spl_kmem_node_t *skn;
+
+	ASSERT(skc->skc_magic == SKC_MAGIC);
+
+	sko = spl_sko_from_obj(skc, obj);
+	ASSERT(sko->sko_magic == SKO_MAGIC);
+	sks = sko->sko_slab;
+	ASSERT(sks->sks_magic == SKS_MAGIC);
+	ASSERT(sks->sks_cache == skc);
+	list_add(&sko->sko_list, &sks->sks_free_list);
+	skn = spl_slab_node(skc, sks);
+
+	sks->sks_age = jiffies;
+	sks->sks_ref--;
+	skc->skc_obj_alloc--;
+	skn->skn_obj_alloc--;
+
+	/*
+	 * Move slab to the node's partial list when no longer full.  Slabs
+	 * are added to the head to keep the partial list is quasi-full
+	 * sorted order.  Fuller at the head, emptier at the tail.
+	 */
+	if (sks->sks_ref == (sks->sks_objs - 1)) {
+		list_del(&sks->sks_list);
+		list_add(&sks->sks_list, &skn->skn_partial_list);
+	}
+
+	/*
+	 * Move empty slabs to the end of the partial list so
+	 * they can be easily found and freed during reclamation.
+	 */
+	if (sks->sks_ref == 0) {
+		list_del(&sks->sks_list);
+		list_add_tail(&sks->sks_list, &skn->skn_partial_list);
+		skc->skc_slab_alloc--;
+		skn->skn_slab_alloc--;
+	}
+}
+
+/*
+ * Slab consolidation (defragmentation)
+ *
+ * Over time a long running cache may accumulate a large number of sparsely
+ * populated slabs on its partial lists.  Since a slab can only be
+ * released once every object on it has been freed, these slabs can end up
+ * pinning a significant amount of memory indefinitely.  For caches which
+ * register a move callback with kmem_cache_set_move() this is addressed by
+ * periodically relocating the live objects of the sparsest slabs in to
+ * fuller slabs.  Emptied slabs are then released back to the system.
+ *
+ * The move callback has the same semantics as on Illumos.  It is passed
+ * the old and new object addresses, the object size, and the cache private
+ * data.  The new object has already been constructed.  The client must
+ * recognize when the old object is not one it has allocated, which may
+ * be the case when it is concurrently sitting in a per-cpu magazine, and
+ * return KMEM_CBRC_DONT_KNOW.  The possible return values are handled as:
+ *
+ *   KMEM_CBRC_YES	 - The object was moved, free the old object.
+ *   KMEM_CBRC_NO	 - The object could not be moved, free the new object.
+ *   KMEM_CBRC_LATER	 - The object could not be moved right now, free the
+ *			   new object and stop consolidating this slab.
+ *   KMEM_CBRC_DONT_NEED - The client freed the old object instead of moving
+ *			   it, free both objects.
+ *   KMEM_CBRC_DONT_KNOW - The object is not known to the client, free the
+ *			   new object.
+ */
+
+/*
+ * Flush the per-cpu magazine, objects held in magazines are considered
+ * allocated by the slab and would otherwise prevent consolidation.
+ */
+static void
+spl_magazine_purge(void *data)
+{
+	spl_kmem_cache_t *skc = (spl_kmem_cache_t *)data;
+	spl_kmem_magazine_t *skm = skc->skc_mag[smp_processor_id()];
+
+	ASSERT(skm->skm_magic == SKM_MAGIC);
+	ASSERT(skm->skm_cpu == smp_processor_id());
+	ASSERT(irqs_disabled());
+
+	if (skm->skm_avail == 0)
+		return;
+
+	/* See spl_magazine_age() for why the lock may not be contended */
+	if (!spin_trylock(&skc->skc_lock))
+		return;
+
+	__spl_cache_flush(skc, skm, skm->skm_avail);
+	spin_unlock(&skc->skc_lock);
+}
+
+/*
+ * Returns the slab new objects should be allocated from when relocating
+ * objects out of the passed slab.  This is the fullest partial slab on the
+ * same node which is not itself being consolidated, provided it is fuller
+ * than the slab being emptied.  Objects are never moved between nodes.
+ * Must be called with the 'skc->skc_lock' held.
+ */
+static spl_kmem_slab_t *
+spl_slab_defrag_dest(spl_kmem_cache_t *skc, spl_kmem_slab_t *src)
+{
+	spl_kmem_node_t *skn = spl_slab_node(skc, src);
+	spl_kmem_slab_t *sks;
+
+	list_for_each_entry(sks, &skn->skn_partial_list, sks_list) {
+		ASSERT(sks->sks_magic == SKS_MAGIC);
+
+		if (sks->sks_defrag)
+			continue;
+
+		if (sks->sks_ref <= src->sks_ref)
+			break;
+
+		return (sks);
+	}
+
+	return (NULL);
+}
+
+/*
+ * Return a slab object which was never handed out to a caller back to
+ * its slab.  The object must have been constructed.
+ */
+static void
+spl_slab_defrag_free(spl_kmem_cache_t *skc, void *obj)
+{
+	if (skc->skc_dtor)
+		skc->skc_dtor(obj, skc->skc_private);
+
+	spin_lock(&skc->skc_lock);
+	spl_cache_shrink(skc, obj);
+	spin_unlock(&skc->skc_lock);
+}
+
+/*
+ * Relocate all live objects from the passed slab.  Returns 0 when the
+ * slab was fully processed, or -EAGAIN when consolidation should stop
+ * because the client requested it or no destination slabs are available.
+ */
+static int
+spl_slab_defrag_one(spl_kmem_cache_t *skc, spl_kmem_slab_t *src)
+{
+	spl_kmem_slab_t *dst;
+	spl_kmem_obj_t *sko;
+	kmem_cbrc_t cbrc;
+	void *old, *new;
+	int i;
+
+	for (i = 0; i < src->sks_objs; i++) {
+		spin_lock(&skc->skc_lock);
+
+		if (src->sks_ref == 0) {
 			spin_unlock(&skc->skc_lock);
+			break;
+		}
+
+		/* Objects on the slab free list are not allocated */
+		old = spl_slab_obj(skc, src, i);
+		sko = spl_sko_from_obj(skc, old);
+		ASSERT(sko->sko_magic == SKO_MAGIC);
+		if (!list_empty(&sko->sko_list)) {
+			spin_unlock(&skc->skc_lock);
+			continue;
+		}
+
+		dst = spl_slab_defrag_dest(skc, src);
+		if (dst == NULL) {
+			spin_unlock(&skc->skc_lock);
+			return (-EAGAIN);
+		}
+
+		new = spl_cache_obj(skc, dst);
+		if (dst->sks_ref == dst->sks_objs) {
+			list_del(&dst->sks_list);
+			list_add(&dst->sks_list,
+			    &spl_slab_node(skc, dst)->skn_complete_list);
+		}
+
+		skc->skc_move_attempt++;
+		spin_unlock(&skc->skc_lock);
+
+		if (skc->skc_ctor &&
+		    skc->skc_ctor(new, skc->skc_private, KM_SLEEP) != 0) {
+			spin_lock(&skc->skc_lock);
+			spl_cache_shrink(skc, new);
+			spin_unlock(&skc->skc_lock);
+			return (-EAGAIN);
+		}
+
+		cbrc = skc->skc_move(old, new, skc->skc_obj_size,
+		    skc->skc_private);
+
+		switch (cbrc) {
+		case KMEM_CBRC_YES:
+			spl_slab_defrag_free(skc, old);
+			spin_lock(&skc->skc_lock);
+			skc->skc_move_yes++;
+			spin_unlock(&skc->skc_lock);
+			break;
+		case KMEM_CBRC_DONT_NEED:
+			spl_slab_defrag_free(skc, old);
+			spl_slab_defrag_free(skc, new);
+			break;
+		case KMEM_CBRC_LATER:
+			spl_slab_defrag_free(skc, new);
+			spin_lock(&skc->skc_lock);
+			skc->skc_move_later++;
+			spin_unlock(&skc->skc_lock);
+			return (-EAGAIN);
+		case KMEM_CBRC_NO:
+		case KMEM_CBRC_DONT_KNOW:
+		default:
+			spl_slab_defrag_free(skc, new);
+			break;
+		}
+
+		cond_resched();
+	}
+
+	return (0);
+}
 
-			local_irq_enable();
-			rc = spl_cache_grow(skc, flags, &obj);
-			local_irq_disable();
+/*
+ * Consolidate the sparsest slabs in a cache.  Up to
+ * SPL_KMEM_CACHE_DEFRAG_SLABS slabs with fewer than
+ * spl_kmem_cache_defrag_pct percent of their objects allocated are
+ * selected from across all nodes and marked so they will neither be
+ * reclaimed nor used as a destination while their objects are being
+ * relocated.  Slabs which are successfully emptied are immediately freed.
+ */
+static void
+spl_slab_defrag(spl_kmem_cache_t *skc)
+{
+	spl_kmem_slab_t *sks, *m, *srcs[SPL_KMEM_CACHE_DEFRAG_SLABS];
+	LIST_HEAD(sks_list);
+	LIST_HEAD(sko_list);
+	int i, node, count = 0, rc = 0;
+	boolean_t fragmented;
 
-			/* Emergency object for immediate use by caller */
-			if (rc == 0 && obj != NULL)
-				return (obj);
+	ASSERT(skc->skc_magic == SKC_MAGIC);
+	ASSERT(skc->skc_move != NULL);
+	ASSERT(skc->skc_flags & (KMC_KMEM | KMC_VMEM));
+	ASSERT(!(skc->skc_flags & KMC_OFFSLAB));
 
-			if (rc)
-				goto out;
+	/*
+	 * Unless at least a slab's worth of objects are free there is no
+	 * way consolidation can release a slab.  Objects in the per-cpu
+	 * magazines are counted as allocated so this check is conservative.
+	 */
+	spin_lock(&skc->skc_lock);
+	fragmented = (skc->skc_obj_total - skc->skc_obj_alloc >=
+	    skc->skc_slab_objs) && (skc->skc_slab_alloc > 1);
+	spin_unlock(&skc->skc_lock);
 
-			/* Rescheduled to different CPU skm is not local */
-			if (skm != skc->skc_mag[smp_processor_id()])
-				goto out;
+	if (!fragmented)
+		return;
 
-			/*
-			 * Potentially rescheduled to the same CPU but
-			 * allocations may have occurred from this CPU while
-			 * we were sleeping so recalculate max refill.
-			 */
-			refill = MIN(refill, skm->skm_size - skm->skm_avail);
+	on_each_cpu(spl_magazine_purge, skc, 1);
+	spl_depot_reap(skc);
 
-			spin_lock(&skc->skc_lock);
-			continue;
+	spin_lock(&skc->skc_lock);
+	for_each_node(node) {
+		list_for_each_entry_reverse(sks,
+		    &skc->skc_node[node].skn_partial_list, sks_list) {
+			if (count >= SPL_KMEM_CACHE_DEFRAG_SLABS)
+				break;
+
+			/* Empty slabs are already reclaimable */
+			if (sks->sks_ref == 0)
+				continue;
+
+			/* Partial slabs are sorted emptiest at the tail */
+			if (sks->sks_ref * 100 >=
+			    sks->sks_objs * spl_kmem_cache_defrag_pct)
+				break;
+
+			sks->sks_defrag = B_TRUE;
+			srcs[count++] = sks;
 		}
+	}
+	spin_unlock(&skc->skc_lock);
 
-		/* Grab the next available slab */
-		sks = list_entry((&skc->skc_partial_list)->next,
-		    spl_kmem_slab_t, sks_list);
-		ASSERT(sks->sks_magic == SKS_MAGIC);
-		ASSERT(sks->sks_ref < sks->sks_objs);
-		ASSERT(!list_empty(&sks->sks_free_list));
-
-		/*
-		 * Consume as many objects as needed to refill the requested
-		 * cache.  We must also be careful not to overfill it.
-		 */
-		while (sks->sks_ref < sks->sks_objs && refill-- > 0 &&
-		    ++count) {
-			ASSERT(skm->skm_avail < skm->skm_size);
-			ASSERT(count < skm->skm_size);
-			skm->skm_objs[skm->skm_avail++] =
-			    spl_cache_obj(skc, sks);
-		}
+	for (i = 0; i < count; i++) {
+		if (rc == 0 && !test_bit(KMC_BIT_DESTROY, &skc->skc_flags))
+			rc = spl_slab_defrag_one(skc, srcs[i]);
 
-		/* Move slab to skc_complete_list when full */
-		if (sks->sks_ref == sks->sks_objs) {
-			list_del(&sks->sks_list);
-			list_add(&sks->sks_list, &skc->skc_complete_list);
+		spin_lock(&skc->skc_lock);
+		sks = srcs[i];
+		sks->sks_defrag = B_FALSE;
+		if (sks->sks_ref == 0) {
+			spl_slab_free(sks, &sks_list, &sko_list);
+			skc->skc_slab_defrag++;
 		}
+		spin_unlock(&skc->skc_lock);
 	}
 
-	spin_unlock(&skc->skc_lock);
-out:
-	return (NULL);
+	/* Only on-slab caches are consolidated, objects need not be freed */
+	list_for_each_entry_safe(sks, m, &sks_list, sks_list) {
+		ASSERT(sks->sks_magic == SKS_MAGIC);
+		kv_free(skc, sks, skc->skc_slab_size);
+	}
 }
 
 /*
- * Release an object back to the slab from which it came.
+ * Called regularly for caches with a registered move callback to
+ * consolidate their slabs.  The task reschedules itself in the same
+ * manner as spl_cache_age() until the cache is destroyed.
  */
 static void
-spl_cache_shrink(spl_kmem_cache_t *skc, void *obj)
+spl_cache_defrag(void *data)
 {
-	spl_kmem_slab_t *sks = NULL;
-	spl_kmem_obj_t *sko = NULL;
+	spl_kmem_cache_t *skc = (spl_kmem_cache_t *)data;
+	taskqid_t id = 0;
 
 	ASSERT(skc->skc_magic == SKC_MAGIC);
 
-	sko = spl_sko_from_obj(skc, obj);
-	ASSERT(sko->sko_magic == SKO_MAGIC);
-	sks = sko->sko_slab;
-	ASSERT(sks->sks_magic == SKS_MAGIC);
-	ASSERT(sks->sks_cache == skc);
-	list_add(&sko->sko_list, &sks->sks_free_list);
+	atomic_inc(&skc->skc_ref);
 
-	sks->sks_age = jiffies;
-	sks->sks_ref--;
-	skc->skc_obj_alloc--;
+	if (spl_kmem_cache_defrag)
+		spl_slab_defrag(skc);
 
-	/*
-	 * Move slab to skc_partial_list when no longer full.  Slabs
-	 * are added to the head to keep the partial list is quasi-full
-	 * sorted order.  Fuller at the head, emptier at the tail.
-	 */
-	if (sks->sks_ref == (sks->sks_objs - 1)) {
-		list_del(&sks->sks_list);
-		list_add(&sks->sks_list, &skc->skc_partial_list);
-	}
+	while (!test_bit(KMC_BIT_DESTROY, &skc->skc_flags) && !id) {
+		id = taskq_dispatch_delay(
+		    spl_kmem_cache_taskq, spl_cache_defrag, skc, TQ_SLEEP,
+		    ddi_get_lbolt() + skc->skc_delay * HZ);
 
-	/*
-	 * Move empty slabs to the end of the partial list so
-	 * they can be easily found and freed during reclamation.
-	 */
-	if (sks->sks_ref == 0) {
-		list_del(&sks->sks_list);
-		list_add_tail(&sks->sks_list, &skc->skc_partial_list);
-		skc->skc_slab_alloc--;
+		/* Destroy issued after dispatch immediately cancel it */
+		if (test_bit(KMC_BIT_DESTROY, &skc->skc_flags) && id)
+			taskq_cancel_id(spl_kmem_cache_taskq, id);
 	}
+
+	spin_lock(&skc->skc_lock);
+	skc->skc_defrag_taskqid = id;
+	spin_unlock(&skc->skc_lock);
+
+	atomic_dec(&skc->skc_ref);
 }
 
 /*
@@ -1446,10 +2848,20 @@ spl_kmem_cache_alloc(spl_kmem_cache_t *skc, int flags)
 	/*
 	 * Allocate directly from a Linux slab.  All optimizations are left
 	 * to the underlying cache we only need to guarantee that KM_SLEEP
-	 * callers will never fail.
+	 * callers will never fail.  When available a still constructed
+	 * object is taken from the per-cpu magazine instead.
 	 */
 	if (skc->skc_flags & KMC_SLAB) {
 		struct kmem_cache *slc = skc->skc_linux_cache;
+
+		if (!(skc->skc_flags & KMC_NOMAGAZINE)) {
+			obj = spl_slab_magazine_alloc(skc);
+			if (obj != NULL) {
+				prefetchw(obj);
+				return (obj);
+			}
+		}
+
 		do {
 			obj = kmem_cache_alloc(slc, kmem_flags_convert(flags));
 		} while ((obj == NULL) && !(flags & KM_NOSLEEP));
@@ -1473,6 +2885,9 @@ restart:
 		/* Object available in CPU cache, use it */
 		obj = skm->skm_objs[--skm->skm_avail];
 		skm->skm_age = jiffies;
+	} else if (spl_depot_alloc(skc, skm) != NULL) {
+		/* Full magazine loaded from the depot, use it */
+		goto restart;
 	} else {
 		obj = spl_cache_refill(skc, skm, flags);
 		if ((obj == NULL) && !(flags & KM_NOSLEEP))
@@ -1516,6 +2931,14 @@ spl_kmem_cache_free(spl_kmem_cache_t *skc, void *obj)
 	ASSERT(skc->skc_magic == SKC_MAGIC);
 	ASSERT(!test_bit(KMC_BIT_DESTROY, &skc->skc_flags));
 
+	/*
+	 * Keep the object constructed in the per-cpu magazine of a cache
+	 * backed by the Linux slab when there is space.
+	 */
+	if ((skc->skc_flags & (KMC_SLAB | KMC_NOMAGAZINE)) == KMC_SLAB &&
+	    spl_slab_magazine_free(skc, obj))
+		return;
+
 	/*
 	 * Run the destructor
 	 */
@@ -1534,12 +2957,11 @@ spl_kmem_cache_free(spl_kmem_cache_t *skc, void *obj)
 	 * While a cache has outstanding emergency objects all freed objects
 	 * must be checked.  However, since emergency objects will never use
 	 * a virtual address these objects can be safely excluded as an
-	 * optimization.
+	 * optimization.  The count is read without the cache lock, it is
+	 * never zero while an object which may be freed is outstanding.
 	 */
 	if (!is_vmalloc_addr(obj)) {
-		spin_lock(&skc->skc_lock);
-		do_emergency = (skc->skc_obj_emergency > 0);
-		spin_unlock(&skc->skc_lock);
+		do_emergency = (ACCESS_ONCE(skc->skc_obj_emergency) > 0);
 
 		if (do_emergency && (spl_emergency_free(skc, obj) == 0))
 			return;
@@ -1557,13 +2979,20 @@ spl_kmem_cache_free(spl_kmem_cache_t *skc, void *obj)
 	ASSERT(skm->skm_magic == SKM_MAGIC);
 
 	/*
-	 * Per-CPU cache full, flush it to make space for this object,
-	 * this may result in an empty slab which can be reclaimed once
-	 * interrupts are re-enabled.
+	 * Per-CPU cache full, exchange it for an empty magazine from the
+	 * depot.  If that is not possible flush it to make space for this
+	 * object, this may result in an empty slab which can be reclaimed
+	 * once interrupts are re-enabled.
 	 */
 	if (unlikely(skm->skm_avail >= skm->skm_size)) {
-		spl_cache_flush(skc, skm, skm->skm_refill);
-		do_reclaim = 1;
+		spl_kmem_magazine_t *empty = spl_depot_free(skc, skm);
+
+		if (empty != NULL) {
+			skm = empty;
+		} else {
+			spl_cache_flush(skc, skm, skm->skm_refill);
+			do_reclaim = 1;
+		}
 	}
 
 	/* Available space in cache, use it */
@@ -1576,6 +3005,309 @@ spl_kmem_cache_free(spl_kmem_cache_t *skc, void *obj)
 }
 EXPORT_SYMBOL(spl_kmem_cache_free);
 
+/*
+ * Release an array of objects in to the per-cpu magazine.  When the
+ * magazine is full and cannot be exchanged for an empty magazine from the
+ * depot the remaining objects are returned directly to their slabs while
+ * holding the cache lock once.  Returns non-zero when this may have
+ * resulted in empty slabs which should be reclaimed.  Must be called
+ * with interrupts disabled.
+ */
+static int
+spl_cache_free_array(spl_kmem_cache_t *skc, void **objs, size_t nr)
+{
+	spl_kmem_magazine_t *skm, *empty;
+	size_t i = 0, count;
+
+	ASSERT(irqs_disabled());
+
+	while (i < nr) {
+		skm = skc->skc_mag[smp_processor_id()];
+		ASSERT(skm->skm_magic == SKM_MAGIC);
+
+		if (skm->skm_avail >= skm->skm_size) {
+			empty = spl_depot_free(skc, skm);
+			if (empty == NULL) {
+				spl_cache_lock(skc);
+				while (i < nr)
+					spl_cache_shrink(skc, objs[i++]);
+				spin_unlock(&skc->skc_lock);
+
+				return (1);
+			}
+
+			skm = empty;
+		}
+
+		count = MIN(skm->skm_size - skm->skm_avail, nr - i);
+		memcpy(&skm->skm_objs[skm->skm_avail], &objs[i],
+		    count * sizeof (void *));
+		skm->skm_avail += count;
+		i += count;
+	}
+
+	return (0);
+}
+
+/*
+ * Free an array of already destructed objects back to an SPL slab backed
+ * cache.  While a cache has outstanding emergency objects every object
+ * must be checked, as in spl_kmem_cache_free(), in which case the objects
+ * are released individually.
+ */
+static void
+__spl_kmem_cache_free_bulk(spl_kmem_cache_t *skc, size_t nr, void **objs)
+{
+	unsigned long irq_flags;
+	int do_reclaim = 0;
+	int do_emergency;
+	size_t i;
+
+	do_emergency = (ACCESS_ONCE(skc->skc_obj_emergency) > 0);
+
+	if (do_emergency) {
+		for (i = 0; i < nr; i++) {
+			if (!is_vmalloc_addr(objs[i]) &&
+			    spl_emergency_free(skc, objs[i]) == 0)
+				continue;
+
+			local_irq_save(irq_flags);
+			do_reclaim |= spl_cache_free_array(skc, &objs[i], 1);
+			local_irq_restore(irq_flags);
+		}
+	} else {
+		local_irq_save(irq_flags);
+		do_reclaim = spl_cache_free_array(skc, objs, nr);
+		local_irq_restore(irq_flags);
+	}
+
+	if (do_reclaim)
+		spl_slab_reclaim(skc);
+}
+
+/*
+ * Allocate an array of nr objects from the cache.  Objects are taken from
+ * the per-cpu magazine and the depot first, the remainder is then taken
+ * directly from the partial slabs in a single pass under the cache lock
+ * rather than repeatedly refilling the magazine.  For caches backed by
+ * the Linux slab the Linux bulk interface is used when available.  Either
+ * all nr objects are allocated and constructed and nr is returned, or no
+ * objects are allocated and 0 is returned.  The latter is only possible
+ * for KM_NOSLEEP allocations.
+ */
+int
+spl_kmem_cache_alloc_bulk(spl_kmem_cache_t *skc, int flags, size_t nr,
+    void **objs)
+{
+	spl_kmem_magazine_t *skm;
+	size_t i = 0, count;
+	void *obj;
+
+	ASSERT0(flags & ~KM_PUBLIC_MASK);
+	ASSERT(skc->skc_magic == SKC_MAGIC);
+	ASSERT(!test_bit(KMC_BIT_DESTROY, &skc->skc_flags));
+
+	if (nr == 0)
+		return (0);
+
+	if (skc->skc_flags & KMC_SLAB) {
+		struct kmem_cache *slc = skc->skc_linux_cache;
+		gfp_t lflags = kmem_flags_convert(flags);
+
+#if defined(HAVE_KMEM_CACHE_ALLOC_BULK)
+		do {
+			if (kmem_cache_alloc_bulk(slc, lflags, nr, objs))
+				i = nr;
+		} while ((i == 0) && !(flags & KM_NOSLEEP));
+#else
+		for (i = 0; i < nr; i++) {
+			do {
+				objs[i] = kmem_cache_alloc(slc, lflags);
+			} while ((objs[i] == NULL) && !(flags & KM_NOSLEEP));
+
+			if (objs[i] == NULL)
+				break;
+		}
+
+		if (i < nr) {
+			while (i > 0)
+				kmem_cache_free(slc, objs[--i]);
+		}
+#endif
+		goto ret;
+	}
+
+	local_irq_disable();
+
+	while (i < nr) {
+		skm = skc->skc_mag[smp_processor_id()];
+		ASSERT(skm->skm_magic == SKM_MAGIC);
+
+		if (skm->skm_avail > 0) {
+			/* Objects available in CPU cache, use them */
+			count = MIN(skm->skm_avail, nr - i);
+			skm->skm_avail -= count;
+			memcpy(&objs[i], &skm->skm_objs[skm->skm_avail],
+			    count * sizeof (void *));
+			skm->skm_age = jiffies;
+			i += count;
+		} else if (spl_depot_alloc(skc, skm) != NULL) {
+			/* Full magazine loaded from the depot, use it */
+			continue;
+		} else {
+			/* Take the remainder directly from the slabs */
+			spl_cache_lock(skc);
+			i += __spl_cache_obj_bulk(skc,
+			    cpu_to_node(skm->skm_cpu), &objs[i], nr - i);
+			spin_unlock(&skc->skc_lock);
+
+			if (i == nr)
+				break;
+
+			/* No partial slabs remain, refill to grow the cache */
+			obj = spl_cache_refill(skc, skm, flags);
+			if (obj != NULL) {
+				objs[i++] = obj;
+				continue;
+			}
+
+			skm = skc->skc_mag[smp_processor_id()];
+			if ((skm->skm_avail == 0) && (flags & KM_NOSLEEP))
+				break;
+		}
+	}
+
+	local_irq_enable();
+
+	if (i < nr) {
+		__spl_kmem_cache_free_bulk(skc, i, objs);
+		i = 0;
+	}
+
+ret:
+	if (i == nr && skc->skc_ctor) {
+		for (i = 0; i < nr; i++)
+			skc->skc_ctor(objs[i], skc->skc_private, flags);
+	}
+
+	return (i);
+}
+EXPORT_SYMBOL(spl_kmem_cache_alloc_bulk);
+
+/*
+ * Free an array of nr objects back to the cache.  The destructor is run
+ * for every object, they are then released in to the per-cpu magazine
+ * and depot in magazine sized batches.  For caches backed by the Linux
+ * slab the Linux bulk interface is used when available.
+ */
+void
+spl_kmem_cache_free_bulk(spl_kmem_cache_t *skc, size_t nr, void **objs)
+{
+	size_t i;
+
+	ASSERT(skc->skc_magic == SKC_MAGIC);
+	ASSERT(!test_bit(KMC_BIT_DESTROY, &skc->skc_flags));
+
+	if (nr == 0)
+		return;
+
+	/*
+	 * Run the destructors
+	 */
+	if (skc->skc_dtor) {
+		for (i = 0; i < nr; i++)
+			skc->skc_dtor(objs[i], skc->skc_private);
+	}
+
+	/*
+	 * Free the objects from the Linux underlying Linux slab.
+	 */
+	if (skc->skc_flags & KMC_SLAB) {
+#if defined(HAVE_KMEM_CACHE_ALLOC_BULK)
+		kmem_cache_free_bulk(skc->skc_linux_cache, nr, objs);
+#else
+		for (i = 0; i < nr; i++)
+			kmem_cache_free(skc->skc_linux_cache, objs[i]);
+#endif
+		return;
+	}
+
+	__spl_kmem_cache_free_bulk(skc, nr, objs);
+}
+EXPORT_SYMBOL(spl_kmem_cache_free_bulk);
+
+/*
+ * A NUMA aware shrinker is called once for each node under pressure.  Work
+ * which applies to the cache as a whole, rather than to a single node, is
+ * only done on behalf of the first online node.  Otherwise it would be
+ * repeated, or counted, once for every node.
+ */
+static boolean_t
+spl_cache_node_whole(int node)
+{
+	return (node == NUMA_NO_NODE || node == first_online_node);
+}
+
+/*
+ * Objects allocated from the slabs on the passed node, or from all slabs
+ * when NUMA_NO_NODE is passed.  These are the objects which may be freed
+ * by the reclaim callback so their slabs can be released.  Caches which
+ * do not track their objects by node report them for a single node.
+ */
+static uint64_t
+spl_cache_node_alloc(spl_kmem_cache_t *skc, int node)
+{
+	if (node == NUMA_NO_NODE)
+		return (skc->skc_obj_alloc);
+
+	if (skc->skc_node == NULL)
+		return (spl_cache_node_whole(node) ? skc->skc_obj_alloc : 0);
+
+	return (skc->skc_node[node].skn_obj_alloc);
+}
+
+#ifdef HAVE_SPLIT_SHRINKER_CALLBACK
+/*
+ * Reclaim on behalf of a NUMA aware shrinker from the passed node.  The
+ * depot is released and then the empty slabs on that node are freed,
+ * these are the cheapest to reclaim and directly relieve the pressure on
+ * the node.  Only when no slabs could be freed from the node is the cache
+ * reaped as a whole, which may invoke the reclaim callback.  A whole cache
+ * reap is only done for a single node of each shrinker pass.
+ */
+static void
+spl_kmem_cache_reap_node(spl_kmem_cache_t *skc, int node, int count)
+{
+	uint64_t objs = 0;
+
+	if (node == NUMA_NO_NODE || (skc->skc_flags & KMC_SLAB) ||
+	    skc->skc_node == NULL) {
+		if (spl_cache_node_whole(node))
+			spl_kmem_cache_reap_now(skc, count);
+		return;
+	}
+
+	atomic_inc(&skc->skc_ref);
+
+	if (test_and_set_bit(KMC_BIT_REAPING, &skc->skc_flags))
+		goto out;
+
+	if (spl_kmem_cache_expire & KMC_EXPIRE_MEM)
+		spl_depot_reap(skc);
+
+	objs = spl_slab_reclaim_node(skc, node);
+
+	clear_bit_unlock(KMC_BIT_REAPING, &skc->skc_flags);
+	smp_mb__after_atomic();
+	wake_up_bit(&skc->skc_flags, KMC_BIT_REAPING);
+
+	if (objs == 0 && spl_cache_node_whole(node))
+		spl_kmem_cache_reap_now(skc, count);
+out:
+	atomic_dec(&skc->skc_ref);
+}
+#endif /* HAVE_SPLIT_SHRINKER_CALLBACK */
+
 /*
  * The generic shrinker function for all caches.  Under Linux a shrinker
  * may not be tightly coupled with a slab cache.  In fact Linux always
@@ -1599,12 +3331,17 @@ EXPORT_SYMBOL(spl_kmem_cache_free);
  * Linux semantics differ from those under Solaris, which are to
  * free all available objects which may (and probably will) be more
  * objects than the requested nr_to_scan.
+ *
+ * On NUMA systems the shrinker is called for each node under pressure.
+ * Only the objects on that node are reported, and the empty slabs on
+ * that node are reclaimed before any cache is reaped as a whole.
  */
 static spl_shrinker_t
 __spl_kmem_cache_generic_shrinker(struct shrinker *shrink,
     struct shrink_control *sc)
 {
 	spl_kmem_cache_t *skc;
+	int node = spl_shrink_control_nid(sc);
 	int alloc = 0;
 
 	/*
@@ -1618,7 +3355,7 @@ __spl_kmem_cache_generic_shrinker(struct shrinker *shrink,
 		if (sc->nr_to_scan) {
 #ifdef HAVE_SPLIT_SHRINKER_CALLBACK
 			uint64_t oldalloc = skc->skc_obj_alloc;
-			spl_kmem_cache_reap_now(skc,
+			spl_kmem_cache_reap_node(skc, node,
 			    MAX(sc->nr_to_scan>>fls64(skc->skc_slab_objs), 1));
 			if (oldalloc > skc->skc_obj_alloc)
 				alloc += oldalloc - skc->skc_obj_alloc;
@@ -1629,7 +3366,7 @@ __spl_kmem_cache_generic_shrinker(struct shrinker *shrink,
 #endif /* HAVE_SPLIT_SHRINKER_CALLBACK */
 		} else {
 			/* Request to query number of freeable objects */
-			alloc += skc->skc_obj_alloc;
+			alloc += spl_cache_node_alloc(skc, node);
 		}
 	}
 	up_read(&spl_kmem_cache_sem);
@@ -1665,11 +3402,17 @@ spl_kmem_cache_reap_now(spl_kmem_cache_t *skc, int count)
 	atomic_inc(&skc->skc_ref);
 
 	/*
-	 * Execute the registered reclaim callback if it exists.
+	 * Execute the registered reclaim callback if it exists, then
+	 * release any constructed objects held in the magazines.
 	 */
 	if (skc->skc_flags & KMC_SLAB) {
 		if (skc->skc_reclaim)
 			skc->skc_reclaim(skc->skc_private);
+
+		if (!(skc->skc_flags & KMC_NOMAGAZINE) &&
+		    (spl_kmem_cache_expire & KMC_EXPIRE_MEM))
+			spl_slab_magazine_reap(skc, B_FALSE);
+
 		goto out;
 	}
 
@@ -1689,8 +3432,8 @@ spl_kmem_cache_reap_now(spl_kmem_cache_t *skc, int count)
 	 * skipped.  Additionally, if no forward progress is detected despite
 	 * a reclaim function the cache will be skipped to avoid deadlock.
 	 *
-	 * Longer term this would be the correct place to add the code which
-	 * repacks the slabs in order minimize fragmentation.
+	 * Repacking the slabs to minimize fragmentation is handled separately
+	 * by spl_cache_defrag() for caches which register a move callback.
 	 */
 	if (skc->skc_reclaim) {
 		uint64_t objects = UINT64_MAX;
@@ -1721,6 +3464,8 @@ spl_kmem_cache_reap_now(spl_kmem_cache_t *skc, int count)
 		skm = skc->skc_mag[smp_processor_id()];
 		spl_cache_flush(skc, skm, skm->skm_avail);
 		local_irq_restore(irq_flags);
+
+		spl_depot_reap(skc);
 	}
 
 	spl_slab_reclaim(skc);
@@ -1740,8 +3485,12 @@ spl_kmem_reap(void)
 {
 	struct shrink_control sc;
 
+	memset(&sc, 0, sizeof (sc));
 	sc.nr_to_scan = KMC_REAP_CHUNK;
 	sc.gfp_mask = GFP_KERNEL;
+#if defined(HAVE_SHRINK_CONTROL_NID)
+	sc.nid = NUMA_NO_NODE;
+#endif
 
 	(void) __spl_kmem_cache_generic_shrinker(NULL, &sc);
 }
@@ -1750,20 +3499,46 @@ EXPORT_SYMBOL(spl_kmem_reap);
 int
 spl_kmem_cache_init(void)
 {
-	init_rwsem(&spl_kmem_cache_sem);
-	INIT_LIST_HEAD(&spl_kmem_cache_list);
+	spl_emergency_init();
 	spl_kmem_cache_taskq = taskq_create("spl_kmem_cache",
 	    spl_kmem_cache_kmem_threads, maxclsyspri,
 	    spl_kmem_cache_kmem_threads * 8, INT_MAX,
 	    TASKQ_PREPOPULATE | TASKQ_DYNAMIC);
+	spl_kmem_cache_grow_taskq = taskq_create("spl_kmem_grow",
+	    spl_kmem_cache_kmem_threads, maxclsyspri,
+	    spl_kmem_cache_kmem_threads * 8, INT_MAX,
+	    TASKQ_PREPOPULATE | TASKQ_DYNAMIC);
 	spl_register_shrinker(&spl_kmem_cache_shrinker);
 
+	spl_kmem_cache_update_stop = B_FALSE;
+	spl_kmem_cache_update_id = taskq_dispatch_delay(spl_kmem_cache_taskq,
+	    spl_kmem_cache_update, NULL, TQ_SLEEP,
+	    ddi_get_lbolt() + SPL_KMEM_CACHE_DELAY * HZ);
+
 	return (0);
 }
 
 void
 spl_kmem_cache_fini(void)
 {
+	taskqid_t id;
+
+	/*
+	 * Stop the periodic magazine resizing.  When the task was running
+	 * it may have rescheduled itself, so cancel the most recent id
+	 * until the task is no longer executing.
+	 */
+	spl_kmem_cache_update_stop = B_TRUE;
+	smp_mb();
+
+	do {
+		spin_lock(&spl_kmem_cache_update_lock);
+		id = spl_kmem_cache_update_id;
+		spin_unlock(&spl_kmem_cache_update_lock);
+	} while (taskq_cancel_id(spl_kmem_cache_taskq, id) == EBUSY);
+
 	spl_unregister_shrinker(&spl_kmem_cache_shrinker);
+	taskq_destroy(spl_kmem_cache_grow_taskq);
 	taskq_destroy(spl_kmem_cache_taskq);
+	spl_emergency_fini();
 }
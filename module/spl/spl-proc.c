@@ -50,6 +50,7 @@ static struct ctl_table_header *spl_header = NULL;
 static struct proc_dir_entry *proc_spl = NULL;
 static struct proc_dir_entry *proc_spl_kmem = NULL;
 static struct proc_dir_entry *proc_spl_kmem_slab = NULL;
+static struct proc_dir_entry *proc_spl_kmem_slab_grow = NULL;
 static struct proc_dir_entry *proc_spl_taskq_all = NULL;
 static struct proc_dir_entry *proc_spl_taskq = NULL;
 struct proc_dir_entry *proc_spl_kstat = NULL;
@@ -235,9 +236,10 @@ taskq_seq_show_headers(struct seq_file *f)
 #define	LHEAD_PEND	0
 #define	LHEAD_PRIO	1
 #define	LHEAD_DELAY	2
-#define	LHEAD_WAIT	3
-#define	LHEAD_ACTIVE	4
-#define	LHEAD_SIZE	5
+#define	LHEAD_BLOCKED	3
+#define	LHEAD_WAIT	4
+#define	LHEAD_ACTIVE	5
+#define	LHEAD_SIZE	6
 
 /* BEGIN CSTYLED */
 static unsigned int spl_max_show_tasks = 512;
@@ -245,6 +247,40 @@ module_param(spl_max_show_tasks, uint, 0644);
 MODULE_PARM_DESC(spl_max_show_tasks, "Max number of tasks shown in taskq proc");
 /* END CSTYLED */
 
+/*
+ * Pending tasks are held on one list per class and delayed tasks in the
+ * slots of the taskq's timer wheel, show all the tasks on such an array
+ * of lists in order.
+ */
+static void
+taskq_seq_show_lists(struct seq_file *f, struct list_head *lists, int nlists,
+    const char *name)
+{
+	taskq_ent_t *tqe;
+	int i, j = 0;
+
+	for (i = 0; i < nlists; i++) {
+		list_for_each_entry(tqe, &lists[i], tqent_list) {
+			if (spl_max_show_tasks != 0 &&
+			    j >= spl_max_show_tasks) {
+				seq_printf(f, "\n\t(truncated)\n");
+				return;
+			}
+			if (j == 0)
+				seq_printf(f, "\t%s:", name);
+			else if (j % 2 == 0)
+				seq_printf(f, "\n\t     ");
+
+			seq_printf(f, " %pf(%ps)",
+			    tqe->tqent_func, tqe->tqent_arg);
+			++j;
+		}
+	}
+
+	if (j > 0)
+		seq_printf(f, "\n");
+}
+
 static int
 taskq_seq_show_impl(struct seq_file *f, void *p, boolean_t allflag)
 {
@@ -256,17 +292,18 @@ taskq_seq_show_impl(struct seq_file *f, void *p, boolean_t allflag)
 	char name[100];
 	struct list_head *lheads[LHEAD_SIZE], *lh;
 	static char *list_names[LHEAD_SIZE] =
-	    {"pend", "prio", "delay", "wait", "active" };
-	int i, j, have_lheads = 0;
+	    {"pend", "prio", "delay", "blocked", "wait", "active" };
+	int i, j, have_lheads = 0, have_pend = 0, have_delay = 0;
 	unsigned long wflags, flags;
 
 	spin_lock_irqsave_nested(&tq->tq_lock, flags, tq->tq_lock_class);
 	spin_lock_irqsave(&tq->tq_wait_waitq.lock, wflags);
 
 	/* get the various lists and check whether they're empty */
-	lheads[LHEAD_PEND] = &tq->tq_pend_list;
+	lheads[LHEAD_PEND] = NULL;
 	lheads[LHEAD_PRIO] = &tq->tq_prio_list;
-	lheads[LHEAD_DELAY] = &tq->tq_delay_list;
+	lheads[LHEAD_DELAY] = NULL;
+	lheads[LHEAD_BLOCKED] = &tq->tq_blocked_list;
 #ifdef HAVE_WAIT_QUEUE_HEAD_ENTRY
 	lheads[LHEAD_WAIT] = &tq->tq_wait_waitq.head;
 #else
@@ -275,12 +312,25 @@ taskq_seq_show_impl(struct seq_file *f, void *p, boolean_t allflag)
 	lheads[LHEAD_ACTIVE] = &tq->tq_active_list;
 
 	for (i = 0; i < LHEAD_SIZE; ++i) {
-		if (list_empty(lheads[i]))
+		if (lheads[i] == NULL || list_empty(lheads[i]))
 			lheads[i] = NULL;
 		else
 			++have_lheads;
 	}
 
+	for (i = 0; i < TASKQ_CLASS_MAX; ++i) {
+		if (!list_empty(&tq->tq_pend_list[i])) {
+			have_pend = 1;
+			++have_lheads;
+			break;
+		}
+	}
+
+	if (tq->tq_wheel != NULL && tq->tq_wheel->tqw_count > 0) {
+		have_delay = 1;
+		++have_lheads;
+	}
+
 	/* early return in non-"all" mode if lists are all empty */
 	if (!allflag && !have_lheads) {
 		spin_unlock_irqrestore(&tq->tq_wait_waitq.lock, wflags);
@@ -320,7 +370,18 @@ taskq_seq_show_impl(struct seq_file *f, void *p, boolean_t allflag)
 		seq_printf(f, "\n");
 	}
 
-	for (i = LHEAD_PEND; i <= LHEAD_WAIT; ++i)
+	for (i = LHEAD_PEND; i <= LHEAD_WAIT; ++i) {
+		if (i == LHEAD_PEND && have_pend) {
+			taskq_seq_show_lists(f, tq->tq_pend_list,
+			    TASKQ_CLASS_MAX, list_names[i]);
+		}
+
+		if (i == LHEAD_DELAY && have_delay) {
+			taskq_seq_show_lists(f, &tq->tq_wheel->tqw_slots[0][0],
+			    TASKQ_WHEEL_LEVELS * TASKQ_WHEEL_SIZE,
+			    list_names[i]);
+		}
+
 		if (lheads[i]) {
 			j = 0;
 			list_for_each(lh, lheads[i]) {
@@ -346,7 +407,7 @@ taskq_seq_show_impl(struct seq_file *f, void *p, boolean_t allflag)
 
 					tsk = wq->private;
 					seq_printf(f, " %d", tsk->pid);
-				/* pend, prio and delay lists */
+				/* pend, prio, delay and blocked lists */
 				} else {
 					tqe = list_entry(lh, taskq_ent_t,
 					    tqent_list);
@@ -364,6 +425,7 @@ taskq_seq_show_impl(struct seq_file *f, void *p, boolean_t allflag)
 			}
 			seq_printf(f, "\n");
 		}
+	}
 	if (lheads[LHEAD_WAIT])
 		spin_unlock_irqrestore(&tq->tq_wait_waitq.lock, wflags);
 	spin_unlock_irqrestore(&tq->tq_lock, flags);
@@ -421,19 +483,63 @@ slab_seq_show_headers(struct seq_file *f)
 	    "---------------------------------------------  "
 	    "----- slab ------  "
 	    "---- object -----  "
-	    "--- emergency ---\n");
+	    "--- emergency ---  "
+	    "----- depot -----  "
+	    "---- magazine ----  "
+	    "------- defrag --------  "
+	    "------- numa ------\n");
 	seq_printf(f,
 	    "name                                  "
 	    "  flags      size     alloc slabsize  objsize  "
 	    "total alloc   max  "
 	    "total alloc   max  "
-	    "dlock alloc   max\n");
+	    "dlock alloc   max  "
+	    " full alloc  free  "
+	    " size   max resize  "
+	    " move   yes later slabs  "
+	    "    local    remote\n");
+}
+
+/*
+ * When there are multiple nodes each cache is followed by a row for every
+ * online node.  These rows report the slabs and objects on that node, and
+ * how many of its objects were refilled in to the magazines of local and
+ * remote cpus.  Must be called with the 'skc->skc_lock' held.
+ */
+static void
+slab_seq_show_nodes(struct seq_file *f, spl_kmem_cache_t *skc)
+{
+	spl_kmem_node_t *skn;
+	int node;
+
+	if (num_online_nodes() <= 1)
+		return;
+
+	for_each_online_node(node) {
+		skn = &skc->skc_node[node];
+		seq_printf(f, "  node %-29d  ", node);
+		seq_printf(f, "%7s %9lu %9lu %8s %8s  "
+		    "%5lu %5lu %5s  %5lu %5lu %5s  "
+		    "%17s  %17s  %18s  %23s  %9lu %9lu\n", "",
+		    (long unsigned)(skc->skc_slab_size * skn->skn_slab_total),
+		    (long unsigned)(skc->skc_obj_size * skn->skn_obj_alloc),
+		    "", "",
+		    (long unsigned)skn->skn_slab_total,
+		    (long unsigned)skn->skn_slab_alloc, "",
+		    (long unsigned)skn->skn_obj_total,
+		    (long unsigned)skn->skn_obj_alloc, "",
+		    "", "", "", "",
+		    (long unsigned)skn->skn_obj_local,
+		    (long unsigned)skn->skn_obj_remote);
+	}
 }
 
 static int
 slab_seq_show(struct seq_file *f, void *p)
 {
 	spl_kmem_cache_t *skc = p;
+	uint64_t local = 0, remote = 0;
+	int node;
 
 	ASSERT(skc->skc_magic == SKC_MAGIC);
 
@@ -444,9 +550,16 @@ slab_seq_show(struct seq_file *f, void *p)
 		return (0);
 
 	spin_lock(&skc->skc_lock);
+	for_each_node(node) {
+		local += skc->skc_node[node].skn_obj_local;
+		remote += skc->skc_node[node].skn_obj_remote;
+	}
+
 	seq_printf(f, "%-36s  ", skc->skc_name);
 	seq_printf(f, "0x%05lx %9lu %9lu %8u %8u  "
-	    "%5lu %5lu %5lu  %5lu %5lu %5lu  %5lu %5lu %5lu\n",
+	    "%5lu %5lu %5lu  %5lu %5lu %5lu  %5lu %5lu %5lu  "
+	    "%5lu %5lu %5lu  %5u %5u %6lu  %5lu %5lu %5lu %5lu  "
+	    "%9lu %9lu\n",
 	    (long unsigned)skc->skc_flags,
 	    (long unsigned)(skc->skc_slab_size * skc->skc_slab_total),
 	    (long unsigned)(skc->skc_obj_size * skc->skc_obj_alloc),
@@ -460,8 +573,71 @@ slab_seq_show(struct seq_file *f, void *p)
 	    (long unsigned)skc->skc_obj_max,
 	    (long unsigned)skc->skc_obj_deadlock,
 	    (long unsigned)skc->skc_obj_emergency,
-	    (long unsigned)skc->skc_obj_emergency_max);
+	    (long unsigned)skc->skc_obj_emergency_max,
+	    (long unsigned)skc->skc_depot_nfull,
+	    (long unsigned)skc->skc_depot_alloc,
+	    (long unsigned)skc->skc_depot_free,
+	    (unsigned)skc->skc_mag_size,
+	    (unsigned)skc->skc_mag_max,
+	    (long unsigned)skc->skc_mag_resize,
+	    (long unsigned)skc->skc_move_attempt,
+	    (long unsigned)skc->skc_move_yes,
+	    (long unsigned)skc->skc_move_later,
+	    (long unsigned)skc->skc_slab_defrag,
+	    (long unsigned)local,
+	    (long unsigned)remote);
+
+	slab_seq_show_nodes(f, skc);
+	spin_unlock(&skc->skc_lock);
 
+	return (0);
+}
+
+static void
+slab_grow_seq_show_headers(struct seq_file *f)
+{
+	int i;
+
+	seq_printf(f,
+	    "--------------------- cache ----------  "
+	    "------ growth ------  "
+	    "---------------------------------- "
+	    "time blocked in grow (usecs) "
+	    "---------------------------------\n");
+	seq_printf(f,
+	    "name                                  "
+	    "lowat  batch   slabs  ");
+	for (i = 0; i < SPL_KMEM_CACHE_GROW_HIST - 1; i++)
+		seq_printf(f, " %5u", 1U << i);
+	seq_printf(f, "  %5s\n", "more");
+}
+
+/*
+ * Each cache reports its per-cpu free object low watermark, the number of
+ * batches and slabs allocated ahead of demand, and a histogram of the time
+ * allocations were blocked waiting for a new slab.  Bucket N counts waits
+ * shorter than 2^N microseconds.
+ */
+static int
+slab_grow_seq_show(struct seq_file *f, void *p)
+{
+	spl_kmem_cache_t *skc = p;
+	int i;
+
+	ASSERT(skc->skc_magic == SKC_MAGIC);
+
+	if (skc->skc_flags & KMC_SLAB)
+		return (0);
+
+	spin_lock(&skc->skc_lock);
+	seq_printf(f, "%-36s  %5u %6lu %7lu  ", skc->skc_name,
+	    (unsigned)skc->skc_grow_lowat,
+	    (long unsigned)skc->skc_grow_batch,
+	    (long unsigned)skc->skc_grow_slabs);
+	for (i = 0; i < SPL_KMEM_CACHE_GROW_HIST - 1; i++)
+		seq_printf(f, " %5lu", (long unsigned)skc->skc_grow_wait[i]);
+	seq_printf(f, "  %5lu\n",
+	    (long unsigned)skc->skc_grow_wait[SPL_KMEM_CACHE_GROW_HIST - 1]);
 	spin_unlock(&skc->skc_lock);
 
 	return (0);
@@ -474,8 +650,12 @@ slab_seq_start(struct seq_file *f, loff_t *pos)
 	loff_t n = *pos;
 
 	down_read(&spl_kmem_cache_sem);
-	if (!n)
-		slab_seq_show_headers(f);
+	if (!n) {
+		if (f->op->show == slab_seq_show)
+			slab_seq_show_headers(f);
+		else
+			slab_grow_seq_show_headers(f);
+	}
 
 	p = spl_kmem_cache_list.next;
 	while (n--) {
@@ -523,6 +703,26 @@ static struct file_operations proc_slab_operations = {
 	.release	= seq_release,
 };
 
+static struct seq_operations slab_grow_seq_ops = {
+	.show  = slab_grow_seq_show,
+	.start = slab_seq_start,
+	.next  = slab_seq_next,
+	.stop  = slab_seq_stop,
+};
+
+static int
+proc_slab_grow_open(struct inode *inode, struct file *filp)
+{
+	return (seq_open(filp, &slab_grow_seq_ops));
+}
+
+static struct file_operations proc_slab_grow_operations = {
+	.open	   = proc_slab_grow_open,
+	.read	   = seq_read,
+	.llseek	 = seq_lseek,
+	.release	= seq_release,
+};
+
 static void
 taskq_seq_stop(struct seq_file *f, void *v)
 {
@@ -748,6 +948,13 @@ spl_proc_init(void)
 		goto out;
 	}
 
+	proc_spl_kmem_slab_grow = proc_create_data("slab_grow", 0444,
+	    proc_spl_kmem, &proc_slab_grow_operations, NULL);
+	if (proc_spl_kmem_slab_grow == NULL) {
+		rc = -EUNATCH;
+		goto out;
+	}
+
 	proc_spl_kstat = proc_mkdir("kstat", proc_spl);
 	if (proc_spl_kstat == NULL) {
 		rc = -EUNATCH;
@@ -756,6 +963,7 @@ spl_proc_init(void)
 out:
 	if (rc) {
 		remove_proc_entry("kstat", proc_spl);
+		remove_proc_entry("slab_grow", proc_spl_kmem);
 		remove_proc_entry("slab", proc_spl_kmem);
 		remove_proc_entry("kmem", proc_spl);
 		remove_proc_entry("taskq-all", proc_spl);
@@ -771,6 +979,7 @@ void
 spl_proc_fini(void)
 {
 	remove_proc_entry("kstat", proc_spl);
+	remove_proc_entry("slab_grow", proc_spl_kmem);
 	remove_proc_entry("slab", proc_spl_kmem);
 	remove_proc_entry("kmem", proc_spl);
 	remove_proc_entry("taskq-all", proc_spl);
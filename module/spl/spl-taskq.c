@@ -27,6 +27,8 @@
 #include <sys/taskq.h>
 #include <sys/kmem.h>
 #include <sys/tsd.h>
+#include <sys/random.h>
+#include <linux/hash.h>
 
 int spl_taskq_thread_bind = 0;
 module_param(spl_taskq_thread_bind, int, 0644);
@@ -47,6 +49,49 @@ module_param(spl_taskq_thread_sequential, int, 0644);
 MODULE_PARM_DESC(spl_taskq_thread_sequential,
 	"Create new taskq threads after N sequential tasks");
 
+int spl_taskq_ent_cache = 16;
+module_param(spl_taskq_ent_cache, int, 0644);
+MODULE_PARM_DESC(spl_taskq_ent_cache,
+	"Max number of free taskq entries cached per CPU by each taskq");
+
+int spl_taskq_thread_linger_ms = 1000;
+module_param(spl_taskq_thread_linger_ms, int, 0644);
+MODULE_PARM_DESC(spl_taskq_thread_linger_ms,
+	"Idle time in milliseconds before surplus dynamic taskq threads exit");
+
+int spl_taskq_thread_hysteresis = 25;
+module_param(spl_taskq_thread_hysteresis, int, 0644);
+MODULE_PARM_DESC(spl_taskq_thread_hysteresis,
+	"Percent drop in load before a dynamic taskq reduces its threads");
+
+int spl_taskq_shard_cpus = 4;
+module_param(spl_taskq_shard_cpus, int, 0644);
+MODULE_PARM_DESC(spl_taskq_shard_cpus,
+	"Number of CPUs sharing each shard of a sharded taskq");
+
+unsigned int spl_taskq_poll_us = 50;
+module_param(spl_taskq_poll_us, uint, 0644);
+MODULE_PARM_DESC(spl_taskq_poll_us,
+	"Time in microseconds idle TASKQ_POLL threads poll before sleeping");
+
+int spl_taskq_ingress = 1;
+module_param(spl_taskq_ingress, int, 0644);
+MODULE_PARM_DESC(spl_taskq_ingress,
+	"Queue TQ_NOSLEEP interrupt context dispatches without the taskq lock");
+
+int spl_taskq_delay_slack_ms = 10;
+module_param(spl_taskq_delay_slack_ms, int, 0644);
+MODULE_PARM_DESC(spl_taskq_delay_slack_ms,
+	"Granularity in milliseconds of delayed task expiration");
+
+/* Largest task id hash table, 32KiB on 64-bit systems */
+#define	TASKQ_ID_HASH_BITS_MAX	12
+
+int spl_taskq_id_hash_bits = 8;
+module_param(spl_taskq_id_hash_bits, int, 0644);
+MODULE_PARM_DESC(spl_taskq_id_hash_bits,
+	"Size of the taskq task id hash table as a power of two");
+
 /* Global system-wide dynamic task queue available for all consumers */
 taskq_t *system_taskq;
 EXPORT_SYMBOL(system_taskq);
@@ -57,6 +102,7 @@ EXPORT_SYMBOL(system_delay_taskq);
 /* Private dedicated taskq for creating new taskq threads on demand. */
 static taskq_t *dynamic_taskq;
 static taskq_thread_t *taskq_thread_create(taskq_t *);
+static int taskq_thread_spawn(taskq_t *);
 
 /* List of all taskqs */
 LIST_HEAD(tq_list);
@@ -92,6 +138,231 @@ taskq_find_by_name(const char *name)
 	return (-1);
 }
 
+/*
+ * Sharded taskqs (TASKQ_SHARDED) consist of a parent taskq_t which has
+ * no threads or lists of its own and a set of shards, one for each group
+ * of spl_taskq_shard_cpus CPUs.  Every shard is a normal taskq with its
+ * own lock, lists, and worker threads so dispatchers running on different
+ * CPUs no longer contend on a single tq_lock.
+ *
+ * Task ids are drawn from a sequence shared by all of the shards and the
+ * index of the owning shard is stored in the low TASKQ_SHARD_BITS of the
+ * id.  This keeps ids unique and ordered across the whole taskq, which is
+ * what taskq_wait_outstanding() relies on, and lets taskq_wait_id() and
+ * taskq_cancel_id() go directly to the shard which owns the task.
+ */
+#define	TASKQ_SHARD_MASK	(TASKQ_SHARD_MAX - 1)
+
+static inline boolean_t
+taskq_is_sharded(taskq_t *tq)
+{
+	return (tq->tq_shards != NULL);
+}
+
+/*
+ * Return the shard serving the current CPU.
+ */
+static taskq_t *
+taskq_shard_cpu(taskq_t *tq)
+{
+	return (tq->tq_shards[tq->tq_shard_map[raw_smp_processor_id()]]);
+}
+
+/*
+ * Return the shard which a task id was dispatched to.
+ */
+static taskq_t *
+taskq_shard_id(taskq_t *tq, taskqid_t id)
+{
+	return (tq->tq_shards[(id & TASKQ_SHARD_MASK) % tq->tq_nshards]);
+}
+
+/*
+ * Return the shard a new task should be queued on.  Tasks dispatched by
+ * a thread of the taskq stay on its shard, all others use the shard which
+ * serves the current CPU.
+ */
+static taskq_t *
+taskq_shard_select(taskq_t *tq)
+{
+	taskq_thread_t *tqt;
+
+	if (!in_interrupt()) {
+		tqt = (taskq_thread_t *)tsd_get(taskq_tsd);
+		if (tqt != NULL && tqt->tqt_tq->tq_parent == tq)
+			return (tqt->tqt_tq);
+	}
+
+	return (taskq_shard_cpu(tq));
+}
+
+/*
+ * Return a shard on the requested NUMA node.  The shard which would
+ * otherwise have been selected is preferred when it is on the node, if
+ * not the current CPU picks between the node's shards.  When the node
+ * has no shards of its own the usual selection is used.
+ */
+static taskq_t *
+taskq_shard_node(taskq_t *tq, int node)
+{
+	taskq_t *stq = taskq_shard_select(tq);
+	int i, n = 0;
+
+	if (node == NUMA_NO_NODE || stq->tq_node == node)
+		return (stq);
+
+	for (i = 0; i < tq->tq_nshards; i++) {
+		if (tq->tq_shards[i]->tq_node == node)
+			n++;
+	}
+
+	if (n == 0)
+		return (stq);
+
+	n = raw_smp_processor_id() % n;
+	for (i = 0; i < tq->tq_nshards; i++) {
+		if (tq->tq_shards[i]->tq_node == node && n-- == 0)
+			break;
+	}
+
+	return (tq->tq_shards[i]);
+}
+
+/*
+ * Distance between consecutive ids assigned by a taskq.
+ */
+static inline taskqid_t
+taskq_id_step(taskq_t *tq)
+{
+	return (tq->tq_parent != NULL ? TASKQ_SHARD_MAX : 1);
+}
+
+/*
+ * Reserves a contiguous range of count ids for newly queued tasks and
+ * returns the first of them.  A shard takes its ids from the parent
+ * sequence.  Ids are reserved without the tq_lock so tasks dispatched from
+ * interrupt context may become outstanding after tasks with larger ids,
+ * see taskq_outstanding_add().
+ */
+static taskqid_t
+taskq_next_id(taskq_t *tq, int count)
+{
+	taskq_t *ptq = tq->tq_parent;
+	long seq;
+
+	ASSERT3S(count, >, 0);
+
+	if (ptq == NULL) {
+		seq = atomic_long_add_return(count, &tq->tq_id_seq) - count;
+		return ((taskqid_t)seq + TASKQID_INITIAL);
+	}
+
+	seq = atomic_long_add_return(count, &ptq->tq_id_seq) - count + 1;
+	return (((taskqid_t)seq << TASKQ_SHARD_BITS) | tq->tq_shard);
+}
+
+/*
+ * Free entries are preferably taken from a small cache for the current
+ * CPU.  Each cache is only modified by its own CPU with interrupts
+ * disabled so entries may be taken from it without the tq_lock.  An entry
+ * remembers the CPU it was taken on and is returned to that CPU's cache
+ * when it is freed, CPUs which dispatch tasks therefore keep their cache
+ * filled even when the tasks are run elsewhere.  Entries freed on another
+ * CPU are pushed on the cache's lockless remote list and collected by the
+ * owning CPU once its own list runs empty.
+ */
+static taskq_ent_t *
+taskq_ent_cache_get(taskq_t *tq)
+{
+	taskq_ent_cache_t *tqec;
+	struct llist_node *node;
+	taskq_ent_t *t, *n;
+	unsigned long flags;
+
+	local_irq_save(flags);
+	tqec = this_cpu_ptr(tq->tq_ent_cache);
+
+	if (list_empty(&tqec->tqec_list) && !llist_empty(&tqec->tqec_remote)) {
+		node = llist_del_all(&tqec->tqec_remote);
+		llist_for_each_entry_safe(t, n, node, tqent_llist) {
+			list_add(&t->tqent_list, &tqec->tqec_list);
+			tqec->tqec_count++;
+			atomic_dec(&tqec->tqec_nremote);
+		}
+	}
+
+	if (list_empty(&tqec->tqec_list)) {
+		local_irq_restore(flags);
+		return (NULL);
+	}
+
+	t = list_first_entry(&tqec->tqec_list, taskq_ent_t, tqent_list);
+	list_del_init(&t->tqent_list);
+	tqec->tqec_count--;
+	t->tqent_cpu = smp_processor_id();
+	local_irq_restore(flags);
+
+	ASSERT(!(t->tqent_flags & TQENT_FLAG_PREALLOC));
+	ASSERT(!(t->tqent_flags & TQENT_FLAG_CANCEL));
+	ASSERT(!(t->tqent_flags & TQENT_FLAG_DELAY));
+
+	return (t);
+}
+
+/*
+ * Return a free entry to the cache of the CPU which allocated it, returns
+ * B_FALSE when that cache is already full.
+ */
+static boolean_t
+taskq_ent_cache_put(taskq_t *tq, taskq_ent_t *t)
+{
+	taskq_ent_cache_t *tqec;
+	unsigned long flags;
+	boolean_t cached = B_FALSE;
+
+	local_irq_save(flags);
+	if (t->tqent_cpu < 0 || t->tqent_cpu == smp_processor_id()) {
+		tqec = this_cpu_ptr(tq->tq_ent_cache);
+		if (tqec->tqec_count < spl_taskq_ent_cache) {
+			list_add(&t->tqent_list, &tqec->tqec_list);
+			tqec->tqec_count++;
+			cached = B_TRUE;
+		}
+	} else {
+		tqec = per_cpu_ptr(tq->tq_ent_cache, t->tqent_cpu);
+		if (atomic_read(&tqec->tqec_nremote) < spl_taskq_ent_cache) {
+			atomic_inc(&tqec->tqec_nremote);
+			llist_add(&t->tqent_llist, &tqec->tqec_remote);
+			cached = B_TRUE;
+		}
+	}
+	local_irq_restore(flags);
+
+	return (cached);
+}
+
+/*
+ * NOTE: Must be called with tq->tq_lock held.  Refill half of this CPU's
+ * empty cache from the free list.  The interrupt ingress path cannot
+ * allocate and only uses the cache, a CPU which ran dry falls back to
+ * the locked dispatch path once and is then supplied again.
+ */
+static void
+taskq_ent_cache_fill(taskq_t *tq)
+{
+	taskq_ent_cache_t *tqec;
+	taskq_ent_t *t;
+
+	tqec = this_cpu_ptr(tq->tq_ent_cache);
+	while (tqec->tqec_count < spl_taskq_ent_cache / 2 &&
+	    !list_empty(&tq->tq_free_list)) {
+		t = list_first_entry(&tq->tq_free_list, taskq_ent_t,
+		    tqent_list);
+		list_move(&t->tqent_list, &tqec->tqec_list);
+		tqec->tqec_count++;
+	}
+}
+
 /*
  * NOTE: Must be called with tq->tq_lock held, returns a list_t which
  * is not attached to the free, work, or pending taskq lists.
@@ -104,15 +375,21 @@ task_alloc(taskq_t *tq, uint_t flags, unsigned long *irqflags)
 
 	ASSERT(tq);
 retry:
+	/* Acquire taskq_ent_t's from this CPU's cache if available */
+	if (!(flags & TQ_NEW) && (t = taskq_ent_cache_get(tq)) != NULL)
+		return (t);
+
 	/* Acquire taskq_ent_t's from free list if available */
 	if (!list_empty(&tq->tq_free_list) && !(flags & TQ_NEW)) {
 		t = list_entry(tq->tq_free_list.next, taskq_ent_t, tqent_list);
 
 		ASSERT(!(t->tqent_flags & TQENT_FLAG_PREALLOC));
 		ASSERT(!(t->tqent_flags & TQENT_FLAG_CANCEL));
-		ASSERT(!timer_pending(&t->tqent_timer));
+		ASSERT(!(t->tqent_flags & TQENT_FLAG_DELAY));
 
 		list_del_init(&t->tqent_list);
+		t->tqent_cpu = smp_processor_id();
+		taskq_ent_cache_fill(tq);
 		return (t);
 	}
 
@@ -137,6 +414,7 @@ retry:
 		 * throttling the task dispatch rate.
 		 */
 		spin_unlock_irqrestore(&tq->tq_lock, *irqflags);
+		this_cpu_inc(tq->tq_stats->tqs_throttled);
 		schedule_timeout(HZ / 100);
 		spin_lock_irqsave_nested(&tq->tq_lock, *irqflags,
 		    tq->tq_lock_class);
@@ -144,6 +422,8 @@ retry:
 			count++;
 			goto retry;
 		}
+
+		this_cpu_inc(tq->tq_stats->tqs_overalloc);
 	}
 
 	spin_unlock_irqrestore(&tq->tq_lock, *irqflags);
@@ -152,6 +432,7 @@ retry:
 
 	if (t) {
 		taskq_init_ent(t);
+		t->tqent_cpu = smp_processor_id();
 		tq->tq_nalloc++;
 	}
 
@@ -168,7 +449,7 @@ task_free(taskq_t *tq, taskq_ent_t *t)
 	ASSERT(tq);
 	ASSERT(t);
 	ASSERT(list_empty(&t->tqent_list));
-	ASSERT(!timer_pending(&t->tqent_timer));
+	ASSERT(!(t->tqent_flags & TQENT_FLAG_DELAY));
 
 	kmem_free(t, sizeof (taskq_ent_t));
 	tq->tq_nalloc--;
@@ -183,6 +464,10 @@ task_done(taskq_t *tq, taskq_ent_t *t)
 {
 	ASSERT(tq);
 	ASSERT(t);
+	ASSERT(list_empty(&t->tqent_order));
+	ASSERT(hlist_unhashed(&t->tqent_hash));
+	ASSERT(list_empty(&t->tqent_waiters));
+	ASSERT3P(t->tqent_done, ==, NULL);
 
 	/* Wake tasks blocked in taskq_wait_id() */
 	wake_up_all(&t->tqent_waitq);
@@ -194,153 +479,481 @@ task_done(taskq_t *tq, taskq_ent_t *t)
 		t->tqent_func = NULL;
 		t->tqent_arg = NULL;
 		t->tqent_flags = 0;
+		t->tqent_ndeps = 0;
 
-		list_add_tail(&t->tqent_list, &tq->tq_free_list);
+		if (!taskq_ent_cache_put(tq, t))
+			list_add_tail(&t->tqent_list, &tq->tq_free_list);
 	} else {
 		task_free(tq, t);
 	}
 }
 
 /*
- * When a delayed task timer expires remove it from the delay list and
- * add it to the priority list in order for immediate processing.
+ * Returns the lowest incomplete taskqid_t.  The taskqid_t may
+ * be queued on the pending list, on the priority list, on the
+ * delay list, or on the work list currently being handled, but
+ * it is not 100% complete yet.
  */
-static void
-task_expire_impl(taskq_ent_t *t)
+static taskqid_t
+taskq_lowest_id(taskq_t *tq)
 {
-	taskq_ent_t *w;
-	taskq_t *tq = t->tqent_taskq;
-	struct list_head *l;
-	unsigned long flags;
+	taskq_ent_t *t;
 
-	spin_lock_irqsave_nested(&tq->tq_lock, flags, tq->tq_lock_class);
+	ASSERT(tq);
 
-	if (t->tqent_flags & TQENT_FLAG_CANCEL) {
-		ASSERT(list_empty(&t->tqent_list));
-		spin_unlock_irqrestore(&tq->tq_lock, flags);
-		return;
-	}
+	if (list_empty(&tq->tq_outstanding))
+		return (tq->tq_next_id);
 
-	t->tqent_birth = jiffies;
-	/*
-	 * The priority list must be maintained in strict task id order
-	 * from lowest to highest for lowest_id to be easily calculable.
-	 */
-	list_del(&t->tqent_list);
-	list_for_each_prev(l, &tq->tq_prio_list) {
-		w = list_entry(l, taskq_ent_t, tqent_list);
-		if (w->tqent_id < t->tqent_id) {
-			list_add(&t->tqent_list, l);
+	t = list_first_entry(&tq->tq_outstanding, taskq_ent_t, tqent_order);
+	ASSERT(t->tqent_id != TASKQID_INVALID);
+
+	return (t->tqent_id);
+}
+
+static inline struct hlist_head *
+taskq_id_hash(taskq_t *tq, taskqid_t id)
+{
+	return (&tq->tq_id_hash[hash_long(id, tq->tq_id_hash_bits)]);
+}
+
+/*
+ * NOTE: Must be called with tq->tq_lock held.  Track a newly dispatched
+ * task as outstanding.  Ids are handed out in increasing order so the
+ * task almost always belongs at the tail of the outstanding list, only
+ * tasks dispatched from interrupt context may need to be placed before
+ * the few tasks dispatched since they reserved their id.  Callers must
+ * splice the ingress list first to keep that window short.  The task is
+ * also added to the id hash used by taskq_find().
+ */
+static void
+taskq_outstanding_add(taskq_t *tq, taskq_ent_t *t)
+{
+	struct list_head *pos;
+
+	ASSERT(list_empty(&t->tqent_order));
+	ASSERT(hlist_unhashed(&t->tqent_hash));
+
+	list_for_each_prev(pos, &tq->tq_outstanding) {
+		if (list_entry(pos, taskq_ent_t, tqent_order)->tqent_id <
+		    t->tqent_id)
 			break;
-		}
 	}
-	if (l == &tq->tq_prio_list)
-		list_add(&t->tqent_list, &tq->tq_prio_list);
 
-	spin_unlock_irqrestore(&tq->tq_lock, flags);
+	list_add(&t->tqent_order, pos);
+	hlist_add_head(&t->tqent_hash, taskq_id_hash(tq, t->tqent_id));
+	tq->tq_next_id = MAX(tq->tq_next_id, t->tqent_id + 1);
 
-	wake_up(&tq->tq_work_waitq);
+	this_cpu_inc(tq->tq_stats->tqs_dispatched);
+	tq->tq_ctl_arrivals++;
+	tq->tq_depth++;
+	tq->tq_maxdepth = MAX(tq->tq_maxdepth, tq->tq_depth);
 }
 
-#ifdef HAVE_KERNEL_TIMER_FUNCTION_TIMER_LIST
+/*
+ * NOTE: Must be called with tq->tq_lock held.  The task has completed or
+ * been canceled and is no longer outstanding.
+ */
 static void
-task_expire(struct timer_list *tl)
+taskq_outstanding_remove(taskq_t *tq, taskq_ent_t *t)
 {
-	taskq_ent_t *t = from_timer(t, tl, tqent_timer);
-	task_expire_impl(t);
+	list_del_init(&t->tqent_order);
+	hlist_del_init(&t->tqent_hash);
+	tq->tq_depth--;
 }
-#else
+
+/*
+ * NOTE: Must be called with tq->tq_lock held.  Substitute a thread's copy
+ * of a preallocated task for the task itself while it executes.  Anything
+ * waiting on the task's completion is carried over to the copy since the
+ * caller may reuse the preallocated task as soon as its function returns.
+ */
 static void
-task_expire(unsigned long data)
+taskq_outstanding_replace(taskq_t *tq, taskq_ent_t *t, taskq_ent_t *dup)
 {
-	task_expire_impl((taskq_ent_t *)data);
+	ASSERT3U(t->tqent_id, ==, dup->tqent_id);
+
+	list_replace_init(&t->tqent_order, &dup->tqent_order);
+	hlist_del_init(&t->tqent_hash);
+	hlist_add_head(&dup->tqent_hash, taskq_id_hash(tq, dup->tqent_id));
+	list_splice_init(&t->tqent_waiters, &dup->tqent_waiters);
+	dup->tqent_done = t->tqent_done;
+	t->tqent_done = NULL;
 }
-#endif
 
 /*
- * Returns the lowest incomplete taskqid_t.  The taskqid_t may
- * be queued on the pending list, on the priority list, on the
- * delay list, or on the work list currently being handled, but
- * it is not 100% complete yet.
+ * NOTE: Must be called with tq->tq_lock held.  Removes a pending task from
+ * the list it is queued on.
  */
-static taskqid_t
-taskq_lowest_id(taskq_t *tq)
+static void
+taskq_remove_ent(taskq_t *tq, taskq_ent_t *t)
 {
-	taskqid_t lowest_id = tq->tq_next_id;
-	taskq_ent_t *t;
-	taskq_thread_t *tqt;
+	if (t->tqent_flags & TQENT_FLAG_DELAY) {
+		t->tqent_flags &= ~TQENT_FLAG_DELAY;
+		tq->tq_wheel->tqw_count--;
+	}
 
-	ASSERT(tq);
+	t->tqent_flags &= ~(TQENT_FLAG_PEND | TQENT_FLAG_BLOCKED |
+	    TQENT_FLAG_HOLD);
+	list_del_init(&t->tqent_list);
+}
 
-	if (!list_empty(&tq->tq_pend_list)) {
-		t = list_entry(tq->tq_pend_list.next, taskq_ent_t, tqent_list);
-		lowest_id = MIN(lowest_id, t->tqent_id);
-	}
+/*
+ * NOTE: Must be called with tq->tq_lock held.  Queue a task on the
+ * pending list of the class it was dispatched to.
+ */
+static void
+taskq_class_add(taskq_t *tq, taskq_ent_t *t, uint_t flags)
+{
+	t->tqent_class = (flags & TQ_CLASS_MASK) >> TQ_CLASS_SHIFT;
+	t->tqent_flags |= TQENT_FLAG_PEND;
+	list_add_tail(&t->tqent_list, &tq->tq_pend_list[t->tqent_class]);
+}
 
-	if (!list_empty(&tq->tq_prio_list)) {
-		t = list_entry(tq->tq_prio_list.next, taskq_ent_t, tqent_list);
-		lowest_id = MIN(lowest_id, t->tqent_id);
+/*
+ * NOTE: Must be called with tq->tq_lock held.  The pending classes are
+ * served by deficit round robin.  The class being served may run up to
+ * its weight in tasks before the next class with pending tasks is
+ * served, a class which runs out of tasks forfeits the rest of its turn.
+ * Returns the pending list the next task should be taken from, or NULL
+ * when there are no pending tasks.  Only taskq_class_charge() advances
+ * the rotation, so a task may be inspected without being run.
+ */
+static struct list_head *
+taskq_class_next(taskq_t *tq)
+{
+	struct list_head *list;
+	int i;
+
+	for (i = 0; i < TASKQ_CLASS_MAX; i++) {
+		list = &tq->tq_pend_list[(tq->tq_class_cur + i) %
+		    TASKQ_CLASS_MAX];
+		if (!list_empty(list))
+			return (list);
 	}
 
-	if (!list_empty(&tq->tq_delay_list)) {
-		t = list_entry(tq->tq_delay_list.next, taskq_ent_t, tqent_list);
-		lowest_id = MIN(lowest_id, t->tqent_id);
+	return (NULL);
+}
+
+/*
+ * NOTE: Must be called with tq->tq_lock held.  Charge a task taken from
+ * a pending list to its class and move on to the next class once the
+ * current one has used its turn.
+ */
+static void
+taskq_class_charge(taskq_t *tq, int class)
+{
+	if (class != tq->tq_class_cur) {
+		tq->tq_class_cur = class;
+		tq->tq_class_credit = tq->tq_class_weight[class];
 	}
 
-	if (!list_empty(&tq->tq_active_list)) {
-		tqt = list_entry(tq->tq_active_list.next, taskq_thread_t,
-		    tqt_active_list);
-		ASSERT(tqt->tqt_id != TASKQID_INVALID);
-		lowest_id = MIN(lowest_id, tqt->tqt_id);
+	if (--tq->tq_class_credit <= 0) {
+		tq->tq_class_cur = (class + 1) % TASKQ_CLASS_MAX;
+		tq->tq_class_credit = tq->tq_class_weight[tq->tq_class_cur];
 	}
+}
 
-	return (lowest_id);
+/*
+ * Delayed tasks are kept in a hierarchical timer wheel rather than each
+ * having a kernel timer of its own.  The wheel has TASKQ_WHEEL_LEVELS
+ * levels of TASKQ_WHEEL_SIZE slots.  A slot at level n spans
+ * TASKQ_WHEEL_SIZE^n ticks, and a task is placed at the lowest level
+ * which can hold its expiration time.  When the wheel reaches the start of
+ * an upper level slot its tasks are cascaded down in to the lower levels,
+ * and the tasks in a level zero slot are moved to the priority list
+ * together when the wheel reaches it.  A single timer per taskq is armed
+ * for the next slot which must be processed, and ticks with nothing to
+ * process are skipped.
+ *
+ * Expiration times are rounded up to a multiple of the
+ * spl_taskq_delay_slack_ms interval so that tasks with similar deadlines
+ * share a slot and are handled by a single timer expiration.
+ */
+#define	TASKQ_WHEEL_MASK	(TASKQ_WHEEL_SIZE - 1)
+#define	TASKQ_WHEEL_SHIFT(l)	((l) * TASKQ_WHEEL_BITS)
+#define	TASKQ_WHEEL_RANGE	(1UL << TASKQ_WHEEL_SHIFT(TASKQ_WHEEL_LEVELS))
+
+static taskq_wheel_t *
+taskq_wheel_alloc(uint_t flags)
+{
+	taskq_wheel_t *tqw;
+	int level, i;
+
+	tqw = kmem_alloc(sizeof (taskq_wheel_t), task_km_flags(flags));
+	if (tqw == NULL)
+		return (NULL);
+
+	tqw->tqw_clk = jiffies;
+	tqw->tqw_count = 0;
+
+	for (level = 0; level < TASKQ_WHEEL_LEVELS; level++)
+		for (i = 0; i < TASKQ_WHEEL_SIZE; i++)
+			INIT_LIST_HEAD(&tqw->tqw_slots[level][i]);
+
+	return (tqw);
 }
 
 /*
- * Insert a task into a list keeping the list sorted by increasing taskqid.
+ * NOTE: Must be called with tq->tq_lock held.  Place a delayed task in the
+ * slot which covers its expiration time.  Tasks beyond the range of the
+ * wheel are placed in the last slot of the top level and are cascaded
+ * back in to the top level until they are in range.
  */
 static void
-taskq_insert_in_order(taskq_t *tq, taskq_thread_t *tqt)
+taskq_wheel_insert(taskq_wheel_t *tqw, taskq_ent_t *t)
 {
-	taskq_thread_t *w;
-	struct list_head *l;
+	unsigned long expire = t->tqent_expire;
+	unsigned long delta;
+	int level;
 
-	ASSERT(tq);
-	ASSERT(tqt);
+	if (time_before(expire, tqw->tqw_clk))
+		expire = tqw->tqw_clk;
 
-	list_for_each_prev(l, &tq->tq_active_list) {
-		w = list_entry(l, taskq_thread_t, tqt_active_list);
-		if (w->tqt_id < tqt->tqt_id) {
-			list_add(&tqt->tqt_active_list, l);
+	delta = expire - tqw->tqw_clk;
+	if (delta >= TASKQ_WHEEL_RANGE) {
+		delta = TASKQ_WHEEL_RANGE - 1;
+		expire = tqw->tqw_clk + delta;
+	}
+
+	for (level = 0; level < TASKQ_WHEEL_LEVELS - 1; level++) {
+		if (delta < (1UL << TASKQ_WHEEL_SHIFT(level + 1)))
+			break;
+	}
+
+	list_add_tail(&t->tqent_list, &tqw->tqw_slots[level]
+	    [(expire >> TASKQ_WHEEL_SHIFT(level)) & TASKQ_WHEEL_MASK]);
+}
+
+/*
+ * NOTE: Must be called with tq->tq_lock held.  Returns the earliest tick,
+ * at or after tqw_clk, at which a non-empty slot must be processed.  The
+ * wheel must not be empty.
+ */
+static unsigned long
+taskq_wheel_next(taskq_wheel_t *tqw)
+{
+	unsigned long clk = tqw->tqw_clk;
+	unsigned long next = clk + TASKQ_WHEEL_RANGE;
+	unsigned long block, tick;
+	int level, i;
+
+	ASSERT3S(tqw->tqw_count, >, 0);
+
+	for (level = 0; level < TASKQ_WHEEL_LEVELS; level++) {
+		/* Upper level slots are processed when they begin */
+		block = clk >> TASKQ_WHEEL_SHIFT(level);
+		if (clk & ((1UL << TASKQ_WHEEL_SHIFT(level)) - 1))
+			block++;
+
+		for (i = 0; i < TASKQ_WHEEL_SIZE; i++) {
+			if (list_empty(&tqw->tqw_slots[level]
+			    [(block + i) & TASKQ_WHEEL_MASK]))
+				continue;
+
+			tick = (block + i) << TASKQ_WHEEL_SHIFT(level);
+			if (time_before(tick, next))
+				next = tick;
 			break;
 		}
 	}
-	if (l == &tq->tq_active_list)
-		list_add(&tqt->tqt_active_list, &tq->tq_active_list);
+
+	return (next);
 }
 
 /*
- * Find and return a task from the given list if it exists.  The list
- * must be in lowest to highest task id order.
+ * NOTE: Must be called with tq->tq_lock held.  Process all the slots of
+ * the wheel up to and including the passed tick.  Expired tasks are moved
+ * to the tail of the priority list and the number moved is returned.
  */
-static taskq_ent_t *
-taskq_find_list(taskq_t *tq, struct list_head *lh, taskqid_t id)
+static int
+taskq_wheel_advance(taskq_t *tq, unsigned long now)
 {
-	struct list_head *l;
+	taskq_wheel_t *tqw = tq->tq_wheel;
+	struct list_head cascade, *slot;
 	taskq_ent_t *t;
+	int level, count = 0;
 
-	list_for_each(l, lh) {
-		t = list_entry(l, taskq_ent_t, tqent_list);
+	INIT_LIST_HEAD(&cascade);
 
-		if (t->tqent_id == id)
-			return (t);
+	while (!time_after(tqw->tqw_clk, now)) {
+		if (tqw->tqw_count == 0) {
+			tqw->tqw_clk = now + 1;
+			break;
+		}
 
-		if (t->tqent_id > id)
+		tqw->tqw_clk = taskq_wheel_next(tqw);
+		if (time_after(tqw->tqw_clk, now)) {
+			tqw->tqw_clk = now + 1;
 			break;
+		}
+
+		/* Cascade the upper level slots which begin at this tick */
+		for (level = 1; level < TASKQ_WHEEL_LEVELS; level++) {
+			if (tqw->tqw_clk &
+			    ((1UL << TASKQ_WHEEL_SHIFT(level)) - 1))
+				break;
+
+			slot = &tqw->tqw_slots[level][(tqw->tqw_clk >>
+			    TASKQ_WHEEL_SHIFT(level)) & TASKQ_WHEEL_MASK];
+			list_splice_init(slot, &cascade);
+
+			while (!list_empty(&cascade)) {
+				t = list_first_entry(&cascade, taskq_ent_t,
+				    tqent_list);
+				list_del_init(&t->tqent_list);
+				taskq_wheel_insert(tqw, t);
+			}
+		}
+
+		/* Move the expired tasks to the priority list */
+		slot = &tqw->tqw_slots[0][tqw->tqw_clk & TASKQ_WHEEL_MASK];
+		while (!list_empty(slot)) {
+			t = list_first_entry(slot, taskq_ent_t, tqent_list);
+			taskq_remove_ent(tq, t);
+			t->tqent_birth = jiffies;
+			t->tqent_queued = gethrtime();
+			list_add_tail(&t->tqent_list, &tq->tq_prio_list);
+			count++;
+		}
+
+		tqw->tqw_clk++;
 	}
 
-	return (NULL);
+	return (count);
+}
+
+/*
+ * NOTE: Must be called with tq->tq_lock held.  Add a delayed task to the
+ * wheel and rearm the timer if the task must be handled sooner.
+ */
+static void
+taskq_wheel_add(taskq_t *tq, taskq_ent_t *t)
+{
+	taskq_wheel_t *tqw = tq->tq_wheel;
+	unsigned long next;
+
+	if (tqw->tqw_count == 0)
+		tqw->tqw_clk = jiffies;
+
+	taskq_wheel_insert(tqw, t);
+	t->tqent_flags |= TQENT_FLAG_DELAY;
+	tqw->tqw_count++;
+
+	next = taskq_wheel_next(tqw);
+	if (!timer_pending(&tq->tq_delay_timer) ||
+	    time_before(next, tq->tq_delay_timer.expires))
+		mod_timer(&tq->tq_delay_timer, next);
+}
+
+/*
+ * NOTE: Must be called with tq->tq_lock held.  Wake up to nr idle threads
+ * for newly queued tasks.  Threads of a TASKQ_POLL taskq which are polling
+ * for work are handed the tasks first, which is much cheaper than waking
+ * a sleeping thread, see taskq_thread_poll().
+ */
+static void
+taskq_wake(taskq_t *tq, int nr)
+{
+	taskq_thread_t *tqt;
+
+	while (nr > 0 && tq->tq_npollers > 0) {
+		tqt = list_first_entry(&tq->tq_poll_list, taskq_thread_t,
+		    tqt_poll_list);
+		list_del_init(&tqt->tqt_poll_list);
+		tq->tq_npollers--;
+		ACCESS_ONCE(tqt->tqt_polling) = 0;
+		nr--;
+	}
+
+	if (nr > 0)
+		wake_up_nr(&tq->tq_work_waitq, nr);
+}
+
+/*
+ * Tasks dispatched with TQ_NOSLEEP from interrupt context are pushed on a
+ * lockless ingress list, see taskq_dispatch_ingress(), rather than spin on
+ * the tq_lock with interrupts disabled.
+ *
+ * NOTE: Must be called with tq->tq_lock held.  Moves the ingress list to
+ * the pending lists in dispatch order and makes the tasks outstanding.
+ * This must be done before the outstanding tasks are inspected.  The
+ * dispatcher which pushed the first task woke a single thread, wake one
+ * for each of the others.
+ */
+static void
+taskq_ingress_splice(taskq_t *tq)
+{
+	struct llist_node *node;
+	taskq_ent_t *t, *n;
+	int count = 0;
+
+	if (llist_empty(&tq->tq_ingress))
+		return;
+
+	node = llist_reverse_order(llist_del_all(&tq->tq_ingress));
+	llist_for_each_entry_safe(t, n, node, tqent_llist) {
+		taskq_class_add(tq, t, TQ_CLASS(t->tqent_class));
+		taskq_outstanding_add(tq, t);
+		count++;
+	}
+
+	if (count > 1)
+		taskq_wake(tq, count - 1);
+}
+
+/*
+ * When the delay timer expires move all the delayed tasks which are due
+ * to the priority list for immediate processing.
+ */
+static void
+task_expire_impl(taskq_t *tq)
+{
+	unsigned long flags;
+	int count = 0;
+
+	spin_lock_irqsave_nested(&tq->tq_lock, flags, tq->tq_lock_class);
+
+	if (tq->tq_wheel != NULL) {
+		count = taskq_wheel_advance(tq, jiffies);
+		if (tq->tq_wheel->tqw_count > 0) {
+			mod_timer(&tq->tq_delay_timer,
+			    taskq_wheel_next(tq->tq_wheel));
+		}
+	}
+
+	if (count > 0)
+		taskq_wake(tq, count);
+
+	spin_unlock_irqrestore(&tq->tq_lock, flags);
+}
+
+#ifdef HAVE_KERNEL_TIMER_FUNCTION_TIMER_LIST
+static void
+task_expire(struct timer_list *tl)
+{
+	taskq_t *tq = from_timer(tq, tl, tq_delay_timer);
+	task_expire_impl(tq);
+}
+#else
+static void
+task_expire(unsigned long data)
+{
+	task_expire_impl((taskq_t *)data);
+}
+#endif
+
+/*
+ * Apply the configured slack to a delayed task's expiration time.
+ */
+static unsigned long
+taskq_delay_slack(unsigned long expire)
+{
+	unsigned long slack = msecs_to_jiffies(spl_taskq_delay_slack_ms);
+
+	if (slack > 1)
+		expire = roundup(expire, slack);
+
+	return (expire);
 }
 
 /*
@@ -348,56 +961,70 @@ taskq_find_list(taskq_t *tq, struct list_head *lh, taskqid_t id)
  * state it is in.  If a task is still pending it will be returned.
  * If a task is executing, then -EBUSY will be returned instead.
  * If the task has already been run then NULL is returned.
+ *
+ * Every outstanding task is kept in the id hash.  A task which is pending
+ * is always linked on a pending, priority, delay, or blocked list,
+ * while an executing task has been removed from them.
  */
 static taskq_ent_t *
-taskq_find(taskq_t *tq, taskqid_t id)
+taskq_lookup(taskq_t *tq, taskqid_t id)
 {
-	taskq_thread_t *tqt;
-	struct list_head *l;
+	struct hlist_node *node;
 	taskq_ent_t *t;
 
-	t = taskq_find_list(tq, &tq->tq_delay_list, id);
-	if (t)
-		return (t);
-
-	t = taskq_find_list(tq, &tq->tq_prio_list, id);
-	if (t)
-		return (t);
-
-	t = taskq_find_list(tq, &tq->tq_pend_list, id);
-	if (t)
-		return (t);
+	taskq_ingress_splice(tq);
 
-	list_for_each(l, &tq->tq_active_list) {
-		tqt = list_entry(l, taskq_thread_t, tqt_active_list);
-		if (tqt->tqt_id == id) {
-			/*
-			 * Instead of returning tqt_task, we just return a non
-			 * NULL value to prevent misuse, since tqt_task only
-			 * has two valid fields.
-			 */
-			return (ERR_PTR(-EBUSY));
-		}
+	hlist_for_each(node, taskq_id_hash(tq, id)) {
+		t = hlist_entry(node, taskq_ent_t, tqent_hash);
+		if (t->tqent_id == id)
+			return (t);
 	}
 
 	return (NULL);
 }
 
+static taskq_ent_t *
+taskq_find(taskq_t *tq, taskqid_t id)
+{
+	taskq_ent_t *t;
+
+	if ((t = taskq_lookup(tq, id)) == NULL)
+		return (NULL);
+
+	/*
+	 * Instead of returning the executing task, we just return
+	 * a non NULL value to prevent misuse, since it may be the
+	 * thread's copy which only has a few valid fields.
+	 */
+	if (list_empty(&t->tqent_list))
+		return (ERR_PTR(-EBUSY));
+
+	return (t);
+}
+
 /*
  * Theory for the taskq_wait_id(), taskq_wait_outstanding(), and
  * taskq_wait() functions below.
  *
  * Taskq waiting is accomplished by tracking the lowest outstanding task
  * id and the next available task id.  As tasks are dispatched they are
- * added to the tail of the pending, priority, or delay lists.  As worker
- * threads become available the tasks are removed from the heads of these
- * lists and linked to the worker threads.  This ensures the lists are
- * kept sorted by lowest to highest task id.
+ * added to the outstanding list in task id order, and they are only
+ * removed from it once they have completed or been canceled.  The list is
+ * therefore always sorted by lowest to highest task id, regardless of
+ * which pending, priority, or delay list the task is queued on or when
+ * it runs.
  *
- * Therefore the lowest outstanding task id can be quickly determined by
- * checking the head item from all of these lists.  This value is stored
- * with the taskq as the lowest id.  It only needs to be recalculated when
- * either the task with the current lowest id completes or is canceled.
+ * Therefore the lowest outstanding task id is simply the id of the first
+ * task on the outstanding list.  Since task ids are assigned in increasing
+ * order a task is almost always added at the tail.  Only tasks dispatched
+ * from interrupt context, which reserve their id before they are added
+ * when the ingress list is spliced, may belong before a few of the most
+ * recent tasks.  Every dispatch splices the ingress list before adding its
+ * own task so this window is kept short.  Adding a task is therefore a
+ * constant time operation in practice and removing one always is, no
+ * matter how many tasks are queued.  A preallocated
+ * task may be reused by its own task function, so while it executes it
+ * is represented on the outstanding list by the thread's copy of it.
  *
  * By blocking until the lowest task id exceeds the passed task id the
  * taskq_wait_outstanding() function can be easily implemented.  Similarly,
@@ -430,6 +1057,11 @@ taskq_wait_id_check(taskq_t *tq, taskqid_t id)
 void
 taskq_wait_id(taskq_t *tq, taskqid_t id)
 {
+	if (taskq_is_sharded(tq)) {
+		taskq_wait_id(taskq_shard_id(tq, id), id);
+		return;
+	}
+
 	wait_event(tq->tq_wait_waitq, taskq_wait_id_check(tq, id));
 }
 EXPORT_SYMBOL(taskq_wait_id);
@@ -441,7 +1073,12 @@ taskq_wait_outstanding_check(taskq_t *tq, taskqid_t id)
 	unsigned long flags;
 
 	spin_lock_irqsave_nested(&tq->tq_lock, flags, tq->tq_lock_class);
-	rc = (id < tq->tq_lowest_id);
+	taskq_ingress_splice(tq);
+	rc = (id < taskq_lowest_id(tq));
+
+	/* Ids are shared between shards, an idle shard has none pending */
+	if (tq->tq_parent != NULL && list_empty(&tq->tq_outstanding))
+		rc = 1;
 	spin_unlock_irqrestore(&tq->tq_lock, flags);
 
 	return (rc);
@@ -457,7 +1094,25 @@ taskq_wait_outstanding_check(taskq_t *tq, taskqid_t id)
 void
 taskq_wait_outstanding(taskq_t *tq, taskqid_t id)
 {
-	id = id ? id : tq->tq_next_id - 1;
+	int i;
+
+	if (taskq_is_sharded(tq)) {
+		if (id == 0) {
+			id = ((taskqid_t)atomic_long_read(&tq->tq_id_seq) <<
+			    TASKQ_SHARD_BITS) | TASKQ_SHARD_MASK;
+		}
+
+		for (i = 0; i < tq->tq_nshards; i++)
+			taskq_wait_outstanding(tq->tq_shards[i], id);
+
+		return;
+	}
+
+	if (id == 0) {
+		id = (taskqid_t)atomic_long_read(&tq->tq_id_seq) +
+		    TASKQID_INITIAL - 1;
+	}
+
 	wait_event(tq->tq_wait_waitq, taskq_wait_outstanding_check(tq, id));
 }
 EXPORT_SYMBOL(taskq_wait_outstanding);
@@ -469,7 +1124,8 @@ taskq_wait_check(taskq_t *tq)
 	unsigned long flags;
 
 	spin_lock_irqsave_nested(&tq->tq_lock, flags, tq->tq_lock_class);
-	rc = (tq->tq_lowest_id == tq->tq_next_id);
+	taskq_ingress_splice(tq);
+	rc = list_empty(&tq->tq_outstanding);
 	spin_unlock_irqrestore(&tq->tq_lock, flags);
 
 	return (rc);
@@ -483,6 +1139,15 @@ taskq_wait_check(taskq_t *tq)
 void
 taskq_wait(taskq_t *tq)
 {
+	int i;
+
+	if (taskq_is_sharded(tq)) {
+		for (i = 0; i < tq->tq_nshards; i++)
+			taskq_wait(tq->tq_shards[i]);
+
+		return;
+	}
+
 	wait_event(tq->tq_wait_waitq, taskq_wait_check(tq));
 }
 EXPORT_SYMBOL(taskq_wait);
@@ -490,50 +1155,154 @@ EXPORT_SYMBOL(taskq_wait);
 int
 taskq_member(taskq_t *tq, kthread_t *t)
 {
-	return (tq == (taskq_t *)tsd_get_by_thread(taskq_tsd, t));
+	taskq_thread_t *tqt;
+	taskq_t *mtq;
+
+	tqt = (taskq_thread_t *)tsd_get_by_thread(taskq_tsd, t);
+	mtq = (tqt != NULL) ? tqt->tqt_tq : NULL;
+
+	return (tq == mtq || (mtq != NULL && mtq->tq_parent == tq));
 }
 EXPORT_SYMBOL(taskq_member);
 
+/*
+ * A task dispatched by taskq_dispatch_dep() waits on each of the tasks it
+ * depends on by linking one of these to the other task.  The dependent task
+ * is referenced by its taskq and id, not by its taskq_ent_t, which may be
+ * canceled, reused, or freed while the node is linked.
+ */
+typedef struct taskq_dep_waiter {
+	struct list_head	tqdw_node;
+	taskq_t			*tqdw_taskq;
+	taskqid_t		tqdw_id;
+} taskq_dep_waiter_t;
+
+/*
+ * Initialize a completion counter.  The counter starts with a single hold
+ * owned by the caller, every task dispatched by taskq_dispatch_dep() with
+ * the counter takes another which is released when the task completes or
+ * is canceled.  Once the caller has dispatched its tasks and dropped its
+ * own hold with taskq_done_rele() the callback is run by whichever thread
+ * drops the last hold.  The callback may be NULL and the counter polled.
+ */
+void
+taskq_done_init(taskq_done_t *tqd, task_func_t func, void *arg)
+{
+	atomic_set(&tqd->tqd_pending, 1);
+	tqd->tqd_func = func;
+	tqd->tqd_arg = arg;
+}
+EXPORT_SYMBOL(taskq_done_init);
+
+void
+taskq_done_hold(taskq_done_t *tqd)
+{
+	ASSERT3S(atomic_read(&tqd->tqd_pending), >, 0);
+	atomic_inc(&tqd->tqd_pending);
+}
+EXPORT_SYMBOL(taskq_done_hold);
+
+void
+taskq_done_rele(taskq_done_t *tqd)
+{
+	ASSERT3S(atomic_read(&tqd->tqd_pending), >, 0);
+	if (atomic_dec_and_test(&tqd->tqd_pending) && tqd->tqd_func != NULL)
+		tqd->tqd_func(tqd->tqd_arg);
+}
+EXPORT_SYMBOL(taskq_done_rele);
+
+/*
+ * Drop count dependencies, and the dispatcher's hold when hold is set, from
+ * a blocked task.  Once neither remain the task is queued on the pending
+ * list of its class to be run like any other task.  Takes tq->tq_lock.
+ */
+static void
+taskq_dep_release(taskq_t *tq, taskqid_t id, int count, boolean_t hold)
+{
+	taskq_ent_t *t;
+	unsigned long flags;
+
+	spin_lock_irqsave_nested(&tq->tq_lock, flags, tq->tq_lock_class);
+
+	t = taskq_lookup(tq, id);
+	if (t == NULL || !(t->tqent_flags & TQENT_FLAG_BLOCKED))
+		goto out;
+
+	/* Goes negative while held when dependencies complete early */
+	t->tqent_ndeps -= count;
+	if (hold)
+		t->tqent_flags &= ~TQENT_FLAG_HOLD;
+
+	ASSERT(t->tqent_ndeps >= 0 || (t->tqent_flags & TQENT_FLAG_HOLD));
+
+	if (t->tqent_ndeps > 0 || (t->tqent_flags & TQENT_FLAG_HOLD))
+		goto out;
+
+	taskq_remove_ent(tq, t);
+	t->tqent_birth = jiffies;
+	t->tqent_queued = gethrtime();
+	taskq_class_add(tq, t, TQ_CLASS(t->tqent_class));
+
+	taskq_wake(tq, 1);
+	if (tq->tq_nactive == tq->tq_nthreads)
+		(void) taskq_thread_spawn(tq);
+out:
+	spin_unlock_irqrestore(&tq->tq_lock, flags);
+}
+
+/*
+ * Signal the completion of a task to the tasks which depend on it and to
+ * its completion counter.  Must be called without any tq_lock held since
+ * the dependent tasks may belong to any taskq and the completion callback
+ * is free to dispatch more work.
+ */
+static void
+taskq_complete(struct list_head *waiters, taskq_done_t *done)
+{
+	taskq_dep_waiter_t *tqdw;
+
+	while (!list_empty(waiters)) {
+		tqdw = list_first_entry(waiters, taskq_dep_waiter_t, tqdw_node);
+		list_del(&tqdw->tqdw_node);
+		taskq_dep_release(tqdw->tqdw_taskq, tqdw->tqdw_id, 1, B_FALSE);
+		kmem_free(tqdw, sizeof (taskq_dep_waiter_t));
+	}
+
+	if (done != NULL)
+		taskq_done_rele(done);
+}
+
 /*
  * Cancel an already dispatched task given the task id.  Still pending tasks
  * will be immediately canceled, and if the task is active the function will
  * block until it completes.  Preallocated tasks which are canceled must be
- * freed by the caller.
+ * freed by the caller.  Canceling a task releases the tasks which depend on
+ * it and its completion counter exactly as if it had run.
  */
 int
 taskq_cancel_id(taskq_t *tq, taskqid_t id)
 {
 	taskq_ent_t *t;
+	taskq_done_t *done = NULL;
+	LIST_HEAD(waiters);
 	int rc = ENOENT;
 	unsigned long flags;
 
 	ASSERT(tq);
 
-	spin_lock_irqsave_nested(&tq->tq_lock, flags, tq->tq_lock_class);
-	t = taskq_find(tq, id);
-	if (t && t != ERR_PTR(-EBUSY)) {
-		list_del_init(&t->tqent_list);
-		t->tqent_flags |= TQENT_FLAG_CANCEL;
-
-		/*
-		 * When canceling the lowest outstanding task id we
-		 * must recalculate the new lowest outstanding id.
-		 */
-		if (tq->tq_lowest_id == t->tqent_id) {
-			tq->tq_lowest_id = taskq_lowest_id(tq);
-			ASSERT3S(tq->tq_lowest_id, >, t->tqent_id);
-		}
+	if (taskq_is_sharded(tq))
+		return (taskq_cancel_id(taskq_shard_id(tq, id), id));
 
-		/*
-		 * The task_expire() function takes the tq->tq_lock so drop
-		 * drop the lock before synchronously cancelling the timer.
-		 */
-		if (timer_pending(&t->tqent_timer)) {
-			spin_unlock_irqrestore(&tq->tq_lock, flags);
-			del_timer_sync(&t->tqent_timer);
-			spin_lock_irqsave_nested(&tq->tq_lock, flags,
-			    tq->tq_lock_class);
-		}
+	spin_lock_irqsave_nested(&tq->tq_lock, flags, tq->tq_lock_class);
+	t = taskq_find(tq, id);
+	if (t && t != ERR_PTR(-EBUSY)) {
+		taskq_remove_ent(tq, t);
+		taskq_outstanding_remove(tq, t);
+		t->tqent_flags |= TQENT_FLAG_CANCEL;
+		this_cpu_inc(tq->tq_stats->tqs_canceled);
+		list_splice_init(&t->tqent_waiters, &waiters);
+		done = t->tqent_done;
+		t->tqent_done = NULL;
 
 		if (!(t->tqent_flags & TQENT_FLAG_PREALLOC))
 			task_done(tq, t);
@@ -542,6 +1311,9 @@ taskq_cancel_id(taskq_t *tq, taskqid_t id)
 	}
 	spin_unlock_irqrestore(&tq->tq_lock, flags);
 
+	/* A canceled task is complete as far as its dependents are concerned */
+	taskq_complete(&waiters, done);
+
 	if (t == ERR_PTR(-EBUSY)) {
 		taskq_wait_id(tq, id);
 		rc = EBUSY;
@@ -551,7 +1323,63 @@ taskq_cancel_id(taskq_t *tq, taskqid_t id)
 }
 EXPORT_SYMBOL(taskq_cancel_id);
 
-static int taskq_thread_spawn(taskq_t *tq);
+/*
+ * Queue a task without taking the tq_lock, the task is made outstanding by
+ * the next thread to take the lock, see taskq_ingress_splice().  No memory
+ * may be allocated so only an entry from this CPU's cache can be used,
+ * otherwise TASKQID_INVALID is returned and the caller falls back to the
+ * locked dispatch path.  The locked path is also used when every thread of
+ * a dynamic taskq is busy so another thread may be spawned.
+ *
+ * The returned id is not on the outstanding list until the list is
+ * spliced.  Every function which looks up or waits on task ids splices
+ * first so the id is visible to taskq_wait_id(), taskq_cancel_id() and
+ * friends as soon as it has been returned.
+ *
+ * The tq_ningress count closes the race with taskq_destroy().  It is
+ * raised before TASKQ_ACTIVE is checked and dropped only once the task
+ * has been pushed, taskq_destroy() clears TASKQ_ACTIVE and then waits for
+ * it to drop to zero before draining the taskq.
+ */
+static taskqid_t
+taskq_dispatch_ingress(taskq_t *tq, task_func_t func, void *arg, uint_t flags)
+{
+	taskq_ent_t *t;
+	taskqid_t id;
+
+	atomic_inc(&tq->tq_ningress);
+	smp_mb__after_atomic();
+
+	if (!(ACCESS_ONCE(tq->tq_flags) & TASKQ_ACTIVE) ||
+	    ((ACCESS_ONCE(tq->tq_flags) & TASKQ_DYNAMIC) &&
+	    ACCESS_ONCE(tq->tq_nactive) >= ACCESS_ONCE(tq->tq_nthreads)) ||
+	    (t = taskq_ent_cache_get(tq)) == NULL) {
+		atomic_dec(&tq->tq_ningress);
+		return (TASKQID_INVALID);
+	}
+
+	t->tqent_id = id = taskq_next_id(tq, 1);
+	t->tqent_func = func;
+	t->tqent_arg = arg;
+	t->tqent_taskq = tq;
+	t->tqent_class = (flags & TQ_CLASS_MASK) >> TQ_CLASS_SHIFT;
+	t->tqent_birth = jiffies;
+	t->tqent_queued = gethrtime();
+
+	/*
+	 * Only a push to an empty list needs to wake a thread, the thread
+	 * which splices the list wakes more as needed.  A polling thread
+	 * watches the list and needs no wakeup.
+	 */
+	if (llist_add(&t->tqent_llist, &tq->tq_ingress) &&
+	    ACCESS_ONCE(tq->tq_npollers) == 0)
+		wake_up(&tq->tq_work_waitq);
+
+	smp_mb__before_atomic();
+	atomic_dec(&tq->tq_ningress);
+
+	return (id);
+}
 
 taskqid_t
 taskq_dispatch(taskq_t *tq, task_func_t func, void *arg, uint_t flags)
@@ -563,7 +1391,23 @@ taskq_dispatch(taskq_t *tq, task_func_t func, void *arg, uint_t flags)
 	ASSERT(tq);
 	ASSERT(func);
 
+	if (taskq_is_sharded(tq)) {
+		return (taskq_dispatch(taskq_shard_select(tq), func, arg,
+		    flags));
+	}
+
+	if ((flags & TQ_NOSLEEP) && !(flags & (TQ_NOQUEUE | TQ_FRONT)) &&
+	    in_interrupt() && spl_taskq_ingress) {
+		rc = taskq_dispatch_ingress(tq, func, arg, flags);
+		if (rc != TASKQID_INVALID)
+			return (rc);
+	}
+
+	/* Take an entry from this CPU's cache before acquiring the lock */
+	t = (flags & TQ_NEW) ? NULL : taskq_ent_cache_get(tq);
+
 	spin_lock_irqsave_nested(&tq->tq_lock, irqflags, tq->tq_lock_class);
+	taskq_ingress_splice(tq);
 
 	/* Taskq being destroyed and all tasks drained */
 	if (!(tq->tq_flags & TASKQ_ACTIVE))
@@ -578,7 +1422,7 @@ taskq_dispatch(taskq_t *tq, task_func_t func, void *arg, uint_t flags)
 			goto out;
 	}
 
-	if ((t = task_alloc(tq, flags, &irqflags)) == NULL)
+	if (t == NULL && (t = task_alloc(tq, flags, &irqflags)) == NULL)
 		goto out;
 
 	spin_lock(&t->tqent_lock);
@@ -590,26 +1434,26 @@ taskq_dispatch(taskq_t *tq, task_func_t func, void *arg, uint_t flags)
 	else if (flags & TQ_FRONT)
 		list_add_tail(&t->tqent_list, &tq->tq_prio_list);
 	else
-		list_add_tail(&t->tqent_list, &tq->tq_pend_list);
+		taskq_class_add(tq, t, flags);
 
-	t->tqent_id = rc = tq->tq_next_id;
-	tq->tq_next_id++;
+	t->tqent_id = rc = taskq_next_id(tq, 1);
+	taskq_outstanding_add(tq, t);
 	t->tqent_func = func;
 	t->tqent_arg = arg;
 	t->tqent_taskq = tq;
-#ifndef HAVE_KERNEL_TIMER_FUNCTION_TIMER_LIST
-	t->tqent_timer.data = 0;
-#endif
-	t->tqent_timer.function = NULL;
-	t->tqent_timer.expires = 0;
 	t->tqent_birth = jiffies;
+	t->tqent_queued = gethrtime();
 
 	ASSERT(!(t->tqent_flags & TQENT_FLAG_PREALLOC));
 
 	spin_unlock(&t->tqent_lock);
 
-	wake_up(&tq->tq_work_waitq);
+	taskq_wake(tq, 1);
 out:
+	/* Return the unused cache entry when the task was not queued */
+	if (rc == TASKQID_INVALID && t != NULL)
+		task_done(tq, t);
+
 	/* Spawn additional taskq threads if required. */
 	if (!(flags & TQ_NOQUEUE) && tq->tq_nactive == tq->tq_nthreads)
 		(void) taskq_thread_spawn(tq);
@@ -619,42 +1463,77 @@ out:
 }
 EXPORT_SYMBOL(taskq_dispatch);
 
+/*
+ * Dispatch a task to a shard on the given NUMA node, typically the node
+ * of the memory or device the task will touch.  Taskqs which are not
+ * sharded have no per-node queues and this is the same as
+ * taskq_dispatch().
+ */
+taskqid_t
+taskq_dispatch_node(taskq_t *tq, task_func_t func, void *arg, uint_t flags,
+    int node)
+{
+	ASSERT(tq);
+	ASSERT(func);
+
+	if (taskq_is_sharded(tq)) {
+		return (taskq_dispatch(taskq_shard_node(tq, node), func, arg,
+		    flags));
+	}
+
+	return (taskq_dispatch(tq, func, arg, flags));
+}
+EXPORT_SYMBOL(taskq_dispatch_node);
+
 taskqid_t
 taskq_dispatch_delay(taskq_t *tq, task_func_t func, void *arg,
     uint_t flags, clock_t expire_time)
 {
 	taskqid_t rc = TASKQID_INVALID;
+	taskq_wheel_t *tqw = NULL;
 	taskq_ent_t *t;
 	unsigned long irqflags;
 
 	ASSERT(tq);
 	ASSERT(func);
 
+	if (taskq_is_sharded(tq)) {
+		return (taskq_dispatch_delay(taskq_shard_cpu(tq), func, arg,
+		    flags, expire_time));
+	}
+
+	/* The timer wheel is allocated on first use */
+	if (ACCESS_ONCE(tq->tq_wheel) == NULL) {
+		if ((tqw = taskq_wheel_alloc(flags)) == NULL)
+			return (rc);
+	}
+
 	spin_lock_irqsave_nested(&tq->tq_lock, irqflags, tq->tq_lock_class);
+	taskq_ingress_splice(tq);
 
 	/* Taskq being destroyed and all tasks drained */
 	if (!(tq->tq_flags & TASKQ_ACTIVE))
 		goto out;
 
+	if (tq->tq_wheel == NULL) {
+		tq->tq_wheel = tqw;
+		tqw = NULL;
+	}
+
 	if ((t = task_alloc(tq, flags, &irqflags)) == NULL)
 		goto out;
 
 	spin_lock(&t->tqent_lock);
 
-	/* Queue to the delay list for subsequent execution */
-	list_add_tail(&t->tqent_list, &tq->tq_delay_list);
-
-	t->tqent_id = rc = tq->tq_next_id;
-	tq->tq_next_id++;
+	t->tqent_id = rc = taskq_next_id(tq, 1);
+	taskq_outstanding_add(tq, t);
 	t->tqent_func = func;
 	t->tqent_arg = arg;
 	t->tqent_taskq = tq;
-#ifndef HAVE_KERNEL_TIMER_FUNCTION_TIMER_LIST
-	t->tqent_timer.data = (unsigned long)t;
-#endif
-	t->tqent_timer.function = task_expire;
-	t->tqent_timer.expires = (unsigned long)expire_time;
-	add_timer(&t->tqent_timer);
+	t->tqent_expire = taskq_delay_slack((unsigned long)expire_time);
+
+	/* Queue to the timer wheel for subsequent execution */
+	taskq_wheel_add(tq, t);
 
 	ASSERT(!(t->tqent_flags & TQENT_FLAG_PREALLOC));
 
@@ -664,6 +1543,10 @@ out:
 	if (tq->tq_nactive == tq->tq_nthreads)
 		(void) taskq_thread_spawn(tq);
 	spin_unlock_irqrestore(&tq->tq_lock, irqflags);
+
+	if (tqw != NULL)
+		kmem_free(tqw, sizeof (taskq_wheel_t));
+
 	return (rc);
 }
 EXPORT_SYMBOL(taskq_dispatch_delay);
@@ -676,8 +1559,14 @@ taskq_dispatch_ent(taskq_t *tq, task_func_t func, void *arg, uint_t flags,
 	ASSERT(tq);
 	ASSERT(func);
 
+	if (taskq_is_sharded(tq)) {
+		taskq_dispatch_ent(taskq_shard_select(tq), func, arg, flags, t);
+		return;
+	}
+
 	spin_lock_irqsave_nested(&tq->tq_lock, irqflags,
 	    tq->tq_lock_class);
+	taskq_ingress_splice(tq);
 
 	/* Taskq being destroyed and all tasks drained */
 	if (!(tq->tq_flags & TASKQ_ACTIVE)) {
@@ -711,18 +1600,19 @@ taskq_dispatch_ent(taskq_t *tq, task_func_t func, void *arg, uint_t flags,
 	if (flags & TQ_FRONT)
 		list_add_tail(&t->tqent_list, &tq->tq_prio_list);
 	else
-		list_add_tail(&t->tqent_list, &tq->tq_pend_list);
+		taskq_class_add(tq, t, flags);
 
-	t->tqent_id = tq->tq_next_id;
-	tq->tq_next_id++;
+	t->tqent_id = taskq_next_id(tq, 1);
+	taskq_outstanding_add(tq, t);
 	t->tqent_func = func;
 	t->tqent_arg = arg;
 	t->tqent_taskq = tq;
 	t->tqent_birth = jiffies;
+	t->tqent_queued = gethrtime();
 
 	spin_unlock(&t->tqent_lock);
 
-	wake_up(&tq->tq_work_waitq);
+	taskq_wake(tq, 1);
 out:
 	/* Spawn additional taskq threads if required. */
 	if (tq->tq_nactive == tq->tq_nthreads)
@@ -732,6 +1622,227 @@ out2:
 }
 EXPORT_SYMBOL(taskq_dispatch_ent);
 
+/*
+ * Dispatch a batch of tasks with a single acquisition of the tq_lock.
+ * Tasks which provide a preallocated taskq_ent_t are handled as they
+ * would be by taskq_dispatch_ent(), entries are allocated for the rest.
+ * The tasks are queued in order and assigned one contiguous range of ids,
+ * the id of each task is returned in its tqb_id.  Either the whole batch
+ * is dispatched and n is returned, or nothing is dispatched and zero is
+ * returned.  Only as many idle threads as there are tasks are woken and
+ * dynamic taskqs spawn threads for any remainder.
+ */
+int
+taskq_dispatch_many(taskq_t *tq, taskq_batch_t *tqb, int n, uint_t flags)
+{
+	LIST_HEAD(batch);
+	struct list_head *list;
+	taskq_ent_t *t;
+	taskqid_t id;
+	unsigned long irqflags;
+	int i, idle, rc = 0;
+
+	ASSERT(tq);
+	ASSERT(tqb);
+	ASSERT(!(flags & TQ_NOQUEUE));
+
+	if (n <= 0)
+		return (0);
+
+	if (taskq_is_sharded(tq))
+		return (taskq_dispatch_many(taskq_shard_select(tq), tqb, n,
+		    flags));
+
+	spin_lock_irqsave_nested(&tq->tq_lock, irqflags, tq->tq_lock_class);
+	taskq_ingress_splice(tq);
+
+	/* Taskq being destroyed and all tasks drained */
+	if (!(tq->tq_flags & TASKQ_ACTIVE))
+		goto out;
+
+	for (i = 0; i < n; i++) {
+		ASSERT(tqb[i].tqb_func);
+
+		if (tqb[i].tqb_ent != NULL)
+			continue;
+
+		if ((t = task_alloc(tq, flags, &irqflags)) == NULL)
+			break;
+
+		list_add_tail(&t->tqent_list, &batch);
+	}
+
+	/* The tq_lock may have been dropped by task_alloc() */
+	if (i < n || !(tq->tq_flags & TASKQ_ACTIVE)) {
+		while (!list_empty(&batch)) {
+			t = list_first_entry(&batch, taskq_ent_t, tqent_list);
+			task_done(tq, t);
+		}
+		goto out;
+	}
+
+	id = taskq_next_id(tq, n);
+
+	for (i = 0; i < n; i++, id += taskq_id_step(tq)) {
+		if (tqb[i].tqb_ent != NULL) {
+			t = tqb[i].tqb_ent;
+		} else {
+			t = list_first_entry(&batch, taskq_ent_t, tqent_list);
+			list_del_init(&t->tqent_list);
+		}
+
+		spin_lock(&t->tqent_lock);
+
+		if (tqb[i].tqb_ent != NULL) {
+			ASSERT(taskq_empty_ent(t));
+			t->tqent_flags |= TQENT_FLAG_PREALLOC;
+		}
+
+		if (flags & TQ_FRONT)
+			list_add_tail(&t->tqent_list, &tq->tq_prio_list);
+		else
+			taskq_class_add(tq, t, flags);
+
+		t->tqent_id = tqb[i].tqb_id = id;
+		taskq_outstanding_add(tq, t);
+		t->tqent_func = tqb[i].tqb_func;
+		t->tqent_arg = tqb[i].tqb_arg;
+		t->tqent_taskq = tq;
+		t->tqent_birth = jiffies;
+		t->tqent_queued = gethrtime();
+
+		spin_unlock(&t->tqent_lock);
+	}
+
+	ASSERT(list_empty(&batch));
+	rc = n;
+
+	/* Wake one idle thread per task and spawn threads for the rest */
+	idle = tq->tq_nthreads - tq->tq_nactive;
+	if (idle > 0)
+		taskq_wake(tq, MIN(idle, n));
+
+	for (i = MAX(idle, 0); i < n; i++) {
+		if (taskq_thread_spawn(tq) == 0)
+			break;
+	}
+out:
+	spin_unlock_irqrestore(&tq->tq_lock, irqflags);
+
+	if (rc == 0) {
+		for (i = 0; i < n; i++)
+			tqb[i].tqb_id = TASKQID_INVALID;
+	}
+
+	return (rc);
+}
+EXPORT_SYMBOL(taskq_dispatch_many);
+
+/*
+ * Dispatch a task which is not run until every task in deps has completed.
+ * The ids in deps must have been returned by dispatching to tq, or when tq
+ * is sharded to any of its shards.  Ids which have already completed, or
+ * been canceled, are ignored.  When done is non-NULL a hold is taken on the
+ * completion counter and released once the task completes.
+ *
+ * The task is first tracked as outstanding on the blocked list, with the
+ * dispatcher holding it there, before each dependency is registered under
+ * the lock of the taskq which owns it.  This ordering ensures a dependency
+ * which completes concurrently either sees the new task as blocked or is
+ * not counted.  Dropping the dispatcher's hold then releases the task if
+ * everything it depends on has already finished.
+ */
+taskqid_t
+taskq_dispatch_dep(taskq_t *tq, task_func_t func, void *arg, uint_t flags,
+    const taskqid_t *deps, int ndeps, taskq_done_t *done)
+{
+	taskq_t *ptq = tq, *dtq;
+	taskq_ent_t *t;
+	taskq_dep_waiter_t *tqdw;
+	taskqid_t id = TASKQID_INVALID;
+	LIST_HEAD(nodes);
+	unsigned long irqflags;
+	int i, count = 0;
+
+	ASSERT(tq);
+	ASSERT(func);
+	ASSERT3S(ndeps, >=, 0);
+	ASSERT(!(flags & (TQ_FRONT | TQ_NOQUEUE)));
+
+	for (i = 0; i < ndeps; i++) {
+		tqdw = kmem_alloc(sizeof (taskq_dep_waiter_t),
+		    task_km_flags(flags));
+		if (tqdw == NULL)
+			goto out;
+
+		list_add(&tqdw->tqdw_node, &nodes);
+	}
+
+	if (taskq_is_sharded(tq))
+		tq = taskq_shard_select(tq);
+
+	spin_lock_irqsave_nested(&tq->tq_lock, irqflags, tq->tq_lock_class);
+	taskq_ingress_splice(tq);
+
+	/* Taskq being destroyed and all tasks drained */
+	if (!(tq->tq_flags & TASKQ_ACTIVE) ||
+	    (t = task_alloc(tq, flags, &irqflags)) == NULL) {
+		spin_unlock_irqrestore(&tq->tq_lock, irqflags);
+		goto out;
+	}
+
+	spin_lock(&t->tqent_lock);
+	list_add_tail(&t->tqent_list, &tq->tq_blocked_list);
+	t->tqent_flags |= (TQENT_FLAG_BLOCKED | TQENT_FLAG_HOLD);
+	t->tqent_class = (flags & TQ_CLASS_MASK) >> TQ_CLASS_SHIFT;
+	t->tqent_id = id = taskq_next_id(tq, 1);
+	taskq_outstanding_add(tq, t);
+	t->tqent_func = func;
+	t->tqent_arg = arg;
+	t->tqent_taskq = tq;
+	t->tqent_done = done;
+	if (done != NULL)
+		taskq_done_hold(done);
+
+	ASSERT(!(t->tqent_flags & TQENT_FLAG_PREALLOC));
+	spin_unlock(&t->tqent_lock);
+	spin_unlock_irqrestore(&tq->tq_lock, irqflags);
+
+	for (i = 0; i < ndeps; i++) {
+		dtq = ptq;
+		if (taskq_is_sharded(ptq))
+			dtq = taskq_shard_id(ptq, deps[i]);
+
+		spin_lock_irqsave_nested(&dtq->tq_lock, irqflags,
+		    dtq->tq_lock_class);
+		if ((t = taskq_lookup(dtq, deps[i])) != NULL) {
+			tqdw = list_first_entry(&nodes, taskq_dep_waiter_t,
+			    tqdw_node);
+			tqdw->tqdw_taskq = tq;
+			tqdw->tqdw_id = id;
+			list_move_tail(&tqdw->tqdw_node, &t->tqent_waiters);
+			count++;
+		}
+		spin_unlock_irqrestore(&dtq->tq_lock, irqflags);
+	}
+
+	/*
+	 * The registered dependencies are added and the hold dropped in one
+	 * step, a dependency which has already completed has decremented the
+	 * count below zero.
+	 */
+	taskq_dep_release(tq, id, -count, B_TRUE);
+out:
+	while (!list_empty(&nodes)) {
+		tqdw = list_first_entry(&nodes, taskq_dep_waiter_t, tqdw_node);
+		list_del(&tqdw->tqdw_node);
+		kmem_free(tqdw, sizeof (taskq_dep_waiter_t));
+	}
+
+	return (id);
+}
+EXPORT_SYMBOL(taskq_dispatch_dep);
+
 int
 taskq_empty_ent(taskq_ent_t *t)
 {
@@ -744,23 +1855,26 @@ taskq_init_ent(taskq_ent_t *t)
 {
 	spin_lock_init(&t->tqent_lock);
 	init_waitqueue_head(&t->tqent_waitq);
-#ifdef HAVE_KERNEL_TIMER_FUNCTION_TIMER_LIST
-	timer_setup(&t->tqent_timer, NULL, 0);
-#else
-	init_timer(&t->tqent_timer);
-#endif
 	INIT_LIST_HEAD(&t->tqent_list);
+	INIT_LIST_HEAD(&t->tqent_order);
+	INIT_HLIST_NODE(&t->tqent_hash);
+	INIT_LIST_HEAD(&t->tqent_waiters);
 	t->tqent_id = 0;
 	t->tqent_func = NULL;
 	t->tqent_arg = NULL;
 	t->tqent_flags = 0;
+	t->tqent_class = 0;
+	t->tqent_cpu = -1;
+	t->tqent_ndeps = 0;
+	t->tqent_done = NULL;
 	t->tqent_taskq = NULL;
 }
 EXPORT_SYMBOL(taskq_init_ent);
 
 /*
  * Return the next pending task, preference is given to tasks on the
- * priority list which were dispatched with TQ_FRONT.
+ * priority list which were dispatched with TQ_FRONT.  Then to the pending
+ * list of the class being served.
  */
 static taskq_ent_t *
 taskq_next_ent(taskq_t *tq)
@@ -769,9 +1883,10 @@ taskq_next_ent(taskq_t *tq)
 
 	if (!list_empty(&tq->tq_prio_list))
 		list = &tq->tq_prio_list;
-	else if (!list_empty(&tq->tq_pend_list))
-		list = &tq->tq_pend_list;
 	else
+		list = taskq_class_next(tq);
+
+	if (list == NULL)
 		return (NULL);
 
 	return (list_entry(list->next, taskq_ent_t, tqent_list));
@@ -821,9 +1936,84 @@ taskq_thread_spawn(taskq_t *tq)
 }
 
 /*
- * Threads in a dynamic taskq should only exit once it has been completely
- * drained and no other threads are actively servicing tasks.  This prevents
- * threads from being created and destroyed more than is required.
+ * Length of the window over which a dynamic taskq's load is sampled.
+ */
+#define	TASKQ_CTL_WINDOW	(HZ / 10)
+
+/*
+ * NOTE: Must be called with tq->tq_lock held.  Size the thread pool of a
+ * dynamic taskq from the load offered to it over the last sample window.
+ * The offered load is the arrival rate multiplied by the measured service
+ * time, the average number of threads needed to keep up.  One more thread
+ * is wanted when tasks were left waiting.  The run time of tasks which are
+ * still executing is included so a window in which long running tasks
+ * complete nothing is not mistaken for an idle taskq.
+ *
+ * The target number of threads grows as soon as the load of a single
+ * window calls for it but only shrinks when the smoothed load has fallen
+ * spl_taskq_thread_hysteresis percent below the target.  Threads above
+ * the target exit once they have been idle for spl_taskq_thread_linger_ms,
+ * an oscillating load therefore does not repeatedly create and destroy
+ * threads.
+ */
+static void
+taskq_ctl_update(taskq_t *tq)
+{
+	unsigned long delta = jiffies - tq->tq_ctl_time;
+	taskq_thread_t *tqt;
+	uint64_t elapsed, offered;
+	hrtime_t now;
+	int load, need, hyst;
+
+	if (!(tq->tq_flags & TASKQ_DYNAMIC) || delta < TASKQ_CTL_WINDOW)
+		return;
+
+	now = gethrtime();
+	list_for_each_entry(tqt, &tq->tq_active_list, tqt_active_list) {
+		tq->tq_ctl_busy += now - tqt->tqt_ctl_start;
+		tqt->tqt_ctl_start = now;
+	}
+
+	elapsed = (uint64_t)jiffies_to_usecs(delta) * NSEC_PER_USEC;
+	offered = tq->tq_ctl_busy;
+	if (tq->tq_ctl_done > 0 && tq->tq_ctl_arrivals > tq->tq_ctl_done) {
+		offered = div64_u64(offered * tq->tq_ctl_arrivals,
+		    tq->tq_ctl_done);
+	}
+
+	load = MIN(div64_u64(offered * 100, elapsed), INT_MAX / 4);
+	tq->tq_ctl_load = (3 * tq->tq_ctl_load + load) / 4;
+
+	need = DIV_ROUND_UP(load, 100);
+	if (taskq_next_ent(tq) != NULL)
+		need++;
+
+	need = MIN(MAX(need, 1), tq->tq_maxthreads);
+	hyst = MIN(MAX(spl_taskq_thread_hysteresis, 0), 100);
+
+	if (need > tq->tq_ctl_target) {
+		tq->tq_ctl_target = need;
+	} else {
+		need = MAX(DIV_ROUND_UP(tq->tq_ctl_load, 100), 1);
+		if (need * 100 <= tq->tq_ctl_target * (100 - hyst))
+			tq->tq_ctl_target = need;
+	}
+
+	tq->tq_ctl_time = jiffies;
+	tq->tq_ctl_arrivals = 0;
+	tq->tq_ctl_done = 0;
+	tq->tq_ctl_busy = 0;
+
+	if (tq->tq_nthreads + tq->tq_nspawn < tq->tq_ctl_target &&
+	    taskq_next_ent(tq) != NULL)
+		(void) taskq_thread_spawn(tq);
+}
+
+/*
+ * Threads in a dynamic taskq should only exit when the taskq has more
+ * threads than its target and they have lingered idle for long enough.
+ * This prevents threads from being created and destroyed more than is
+ * required.
  *
  * The first thread is the thread list is treated as the primary thread.
  * There is nothing special about the primary thread but in order to avoid
@@ -832,6 +2022,8 @@ taskq_thread_spawn(taskq_t *tq)
 static int
 taskq_thread_should_stop(taskq_t *tq, taskq_thread_t *tqt)
 {
+	unsigned long linger;
+
 	if (!(tq->tq_flags & TASKQ_DYNAMIC))
 		return (0);
 
@@ -839,14 +2031,244 @@ taskq_thread_should_stop(taskq_t *tq, taskq_thread_t *tqt)
 	    tqt_thread_list) == tqt)
 		return (0);
 
+	taskq_ctl_update(tq);
+	linger = msecs_to_jiffies(MAX(spl_taskq_thread_linger_ms, 0));
+
 	return
 	    ((tq->tq_nspawn == 0) &&	/* No threads are being spawned */
-	    (tq->tq_nactive == 0) &&	/* No threads are handling tasks */
+	    (tq->tq_nthreads > tq->tq_ctl_target) && /* More than needed */
 	    (tq->tq_nthreads > 1) &&	/* More than 1 thread is running */
+	    time_after_eq(jiffies, tqt->tqt_idle + linger) && /* Lingered */
 	    (!taskq_next_ent(tq)) &&	/* There are no pending tasks */
 	    (spl_taskq_thread_dynamic)); /* Dynamic taskqs are allowed */
 }
 
+/*
+ * Account for a task's time in one of the taskq's per-CPU histograms.
+ */
+static inline void
+taskq_stats_hist(uint64_t __percpu *hist, hrtime_t delta)
+{
+	int bucket;
+
+	bucket = highbit64(NSEC2USEC(MAX(delta, 0)));
+	bucket = MIN(bucket, TASKQ_HIST_BUCKETS - 1);
+
+	this_cpu_inc(hist[bucket]);
+}
+
+/*
+ * NOTE: Must be called with tq->tq_lock held.  Run the passed task on
+ * behalf of the taskq, the lock is dropped while the task function is
+ * executing and reacquired before returning.  A task is accounted for by
+ * the taskq it was dispatched to even when it is run by a thread from a
+ * sibling shard.  This way the taskq_wait*() functions only ever need to
+ * consult the shard which owns the task id.  The thread itself remains
+ * counted as active by its own shard, see taskq_thread_steal(), while the
+ * owning shard only counts it in tq_nstolen.
+ */
+static void
+taskq_thread_run(taskq_t *tq, taskq_thread_t *tqt, taskq_ent_t *t,
+    taskq_ent_t *dup_task, unsigned long *flags)
+{
+	hrtime_t start, exec;
+	taskq_done_t *done;
+	LIST_HEAD(waiters);
+
+	if (t->tqent_flags & TQENT_FLAG_PEND)
+		taskq_class_charge(tq, t->tqent_class);
+
+	taskq_remove_ent(tq, t);
+
+	/*
+	 * A TQENT_FLAG_PREALLOC task may be reused or freed during the
+	 * task function call. Store tqent_id and tqent_flags here.
+	 *
+	 * Also use an on stack taskq_ent_t for tqt_task assignment in
+	 * this case. We only populate the two fields used by the only
+	 * user in taskq proc file.
+	 */
+	tqt->tqt_id = t->tqent_id;
+	tqt->tqt_flags = t->tqent_flags;
+
+	start = gethrtime();
+	taskq_stats_hist(tq->tq_stats->tqs_wait, start - t->tqent_queued);
+
+	if (t->tqent_flags & TQENT_FLAG_PREALLOC) {
+		dup_task->tqent_id = t->tqent_id;
+		dup_task->tqent_func = t->tqent_func;
+		dup_task->tqent_arg = t->tqent_arg;
+		taskq_outstanding_replace(tq, t, dup_task);
+		t = dup_task;
+	}
+	tqt->tqt_task = t;
+	tqt->tqt_ctl_start = start;
+
+	if (tqt->tqt_tq == tq) {
+		list_add_tail(&tqt->tqt_active_list, &tq->tq_active_list);
+		tq->tq_nactive++;
+	} else {
+		tq->tq_nstolen++;
+	}
+	spin_unlock_irqrestore(&tq->tq_lock, *flags);
+
+	/* Perform the requested task */
+	t->tqent_func(t->tqent_arg);
+
+	exec = gethrtime() - start;
+	taskq_stats_hist(tq->tq_stats->tqs_exec, exec);
+	this_cpu_inc(tq->tq_stats->tqs_completed);
+
+	spin_lock_irqsave_nested(&tq->tq_lock, *flags, tq->tq_lock_class);
+	tq->tq_ctl_done++;
+	tq->tq_ctl_busy += start + exec - tqt->tqt_ctl_start;
+	tqt->tqt_ctl_start = start + exec;
+	taskq_ctl_update(tq);
+	if (tqt->tqt_tq == tq) {
+		tq->tq_nactive--;
+		list_del_init(&tqt->tqt_active_list);
+	} else {
+		tq->tq_nstolen--;
+	}
+	taskq_outstanding_remove(tq, t);
+	tqt->tqt_task = NULL;
+	list_splice_init(&t->tqent_waiters, &waiters);
+	done = t->tqent_done;
+	t->tqent_done = NULL;
+
+	/* For prealloc'd tasks, we don't free anything. */
+	if (!(tqt->tqt_flags & TQENT_FLAG_PREALLOC))
+		task_done(tq, t);
+
+	tqt->tqt_id = TASKQID_INVALID;
+	tqt->tqt_flags = 0;
+	tqt->tqt_idle = jiffies;
+
+	if (!list_empty(&waiters) || done != NULL) {
+		spin_unlock_irqrestore(&tq->tq_lock, *flags);
+		taskq_complete(&waiters, done);
+		spin_lock_irqsave_nested(&tq->tq_lock, *flags,
+		    tq->tq_lock_class);
+	}
+
+	wake_up_all(&tq->tq_wait_waitq);
+}
+
+/*
+ * An idle shard thread may run tasks pending on a sibling shard when all
+ * of the sibling's threads are busy.  The shard lock is dropped while the
+ * siblings are checked and is held again on return.  Returns B_TRUE when
+ * a task was run.
+ *
+ * The thread is counted as active by its own shard for the duration,
+ * which is the only shard whose lock protects its accounting.  Counting it
+ * against the sibling instead would push the sibling's tq_nactive past
+ * its tq_nthreads.
+ */
+static boolean_t
+taskq_thread_steal(taskq_t *tq, taskq_thread_t *tqt, taskq_ent_t *dup_task,
+    unsigned long *flags)
+{
+	taskq_t *ptq = tq->tq_parent;
+	taskq_t *vtq;
+	taskq_ent_t *t;
+	unsigned long vflags;
+	boolean_t stolen = B_FALSE;
+	uint32_t start;
+	int i;
+
+	ASSERT(ptq);
+	ASSERT3S(tq->tq_nactive, <, tq->tq_nthreads);
+	tq->tq_nactive++;
+	spin_unlock_irqrestore(&tq->tq_lock, *flags);
+
+	(void) random_get_pseudo_bytes((uint8_t *)&start, sizeof (start));
+
+	for (i = 0; i < ptq->tq_nshards && !stolen; i++) {
+		vtq = ptq->tq_shards[(start + i) % ptq->tq_nshards];
+		if (vtq == tq)
+			continue;
+
+		/* Unlocked hint, it is verified under the shard lock */
+		if (ACCESS_ONCE(vtq->tq_nactive) <
+		    ACCESS_ONCE(vtq->tq_nthreads))
+			continue;
+
+		spin_lock_irqsave_nested(&vtq->tq_lock, vflags,
+		    vtq->tq_lock_class);
+		if (vtq->tq_nactive == vtq->tq_nthreads &&
+		    (t = taskq_next_ent(vtq)) != NULL) {
+			__set_current_state(TASK_RUNNING);
+			taskq_thread_run(vtq, tqt, t, dup_task, &vflags);
+			stolen = B_TRUE;
+		}
+		spin_unlock_irqrestore(&vtq->tq_lock, vflags);
+	}
+
+	spin_lock_irqsave_nested(&tq->tq_lock, *flags, tq->tq_lock_class);
+	tq->tq_nactive--;
+
+	return (stolen);
+}
+
+/*
+ * NOTE: Must be called with tq->tq_lock held, which is dropped while the
+ * thread polls.  Rather than immediately sleeping an idle thread of a
+ * TASKQ_POLL taskq spins for up to spl_taskq_poll_us waiting to be handed
+ * work by taskq_wake().  This avoids the cost of a wakeup for tasks which
+ * arrive in quick succession.  Polling stops early when another process
+ * needs the cpu.  The caller must check for work again after polling.
+ */
+static void
+taskq_thread_poll(taskq_t *tq, taskq_thread_t *tqt, unsigned long *flags)
+{
+	hrtime_t deadline;
+
+	tqt->tqt_polling = 1;
+	list_add(&tqt->tqt_poll_list, &tq->tq_poll_list);
+	tq->tq_npollers++;
+	spin_unlock_irqrestore(&tq->tq_lock, *flags);
+
+	deadline = gethrtime() + USEC2NSEC(spl_taskq_poll_us);
+	while (ACCESS_ONCE(tqt->tqt_polling) && llist_empty(&tq->tq_ingress) &&
+	    !need_resched() && !kthread_should_stop() && gethrtime() < deadline)
+		cpu_relax();
+
+	spin_lock_irqsave_nested(&tq->tq_lock, *flags, tq->tq_lock_class);
+	if (tqt->tqt_polling) {
+		tqt->tqt_polling = 0;
+		list_del_init(&tqt->tqt_poll_list);
+		tq->tq_npollers--;
+
+		/* Pairs with taskq_dispatch_ingress() skipping the wakeup */
+		smp_mb();
+	}
+}
+
+/*
+ * Add the cpu time, context switches, and run queue delay accumulated by
+ * a taskq thread to tqu.  The counters of another running thread are read
+ * without synchronization and may be slightly stale.  The run queue delay
+ * is only maintained by kernels built with scheduler statistics.
+ */
+static void
+taskq_thread_usage(struct task_struct *tsk, taskq_usage_t *tqu)
+{
+#ifdef HAVE_TASK_CPUTIME_NSEC
+	tqu->tqu_utime += ACCESS_ONCE(tsk->utime);
+	tqu->tqu_stime += ACCESS_ONCE(tsk->stime);
+#else
+	tqu->tqu_utime += cputime_to_nsecs(ACCESS_ONCE(tsk->utime));
+	tqu->tqu_stime += cputime_to_nsecs(ACCESS_ONCE(tsk->stime));
+#endif
+	tqu->tqu_nvcsw += ACCESS_ONCE(tsk->nvcsw);
+	tqu->tqu_nivcsw += ACCESS_ONCE(tsk->nivcsw);
+#if defined(CONFIG_SCHED_INFO) || defined(CONFIG_SCHEDSTATS) || \
+	defined(CONFIG_TASK_DELAY_ACCT)
+	tqu->tqu_delay += ACCESS_ONCE(tsk->sched_info.run_delay);
+#endif
+}
+
 static int
 taskq_thread(void *args)
 {
@@ -856,6 +2278,8 @@ taskq_thread(void *args)
 	taskq_t *tq;
 	taskq_ent_t *t;
 	int seq_tasks = 0;
+	boolean_t polled = B_FALSE;
+	boolean_t surplus;
 	unsigned long flags;
 	taskq_ent_t dup_task = {};
 
@@ -864,13 +2288,18 @@ taskq_thread(void *args)
 	tq = tqt->tqt_tq;
 	current->flags |= PF_NOFREEZE;
 
+	/* An executing task is never linked on a list, see taskq_find() */
+	INIT_LIST_HEAD(&dup_task.tqent_list);
+	INIT_HLIST_NODE(&dup_task.tqent_hash);
+	INIT_LIST_HEAD(&dup_task.tqent_waiters);
+
 	(void) spl_fstrans_mark();
 
 	sigfillset(&blocked);
 	sigprocmask(SIG_BLOCK, &blocked, NULL);
 	flush_signals(current);
 
-	tsd_set(taskq_tsd, tq);
+	tsd_set(taskq_tsd, tqt);
 	spin_lock_irqsave_nested(&tq->tq_lock, flags, tq->tq_lock_class);
 	/*
 	 * If we are dynamically spawned, decrease spawning count. Note that
@@ -886,24 +2315,61 @@ taskq_thread(void *args)
 		goto error;
 
 	tq->tq_nthreads++;
+	this_cpu_inc(tq->tq_stats->tqs_spawned);
 	list_add_tail(&tqt->tqt_thread_list, &tq->tq_thread_list);
 	wake_up(&tq->tq_wait_waitq);
 	set_current_state(TASK_INTERRUPTIBLE);
 
 	while (!kthread_should_stop()) {
 
-		if (list_empty(&tq->tq_pend_list) &&
+		taskq_ingress_splice(tq);
+
+		if (taskq_class_next(tq) == NULL &&
 		    list_empty(&tq->tq_prio_list)) {
 
-			if (taskq_thread_should_stop(tq, tqt)) {
-				wake_up_all(&tq->tq_wait_waitq);
-				break;
+			if (taskq_thread_should_stop(tq, tqt)) {
+				wake_up_all(&tq->tq_wait_waitq);
+				break;
+			}
+
+			/* Help busy sibling shards before going to sleep */
+			if (tq->tq_parent != NULL &&
+			    (taskq_thread_steal(tq, tqt, &dup_task, &flags) ||
+			    taskq_next_ent(tq) != NULL)) {
+				set_current_state(TASK_INTERRUPTIBLE);
+				continue;
+			}
+
+			/* Poll once for new work before going to sleep */
+			if ((tq->tq_flags & TASKQ_POLL) && !polled &&
+			    spl_taskq_poll_us > 0) {
+				__set_current_state(TASK_RUNNING);
+				taskq_thread_poll(tq, tqt, &flags);
+				polled = B_TRUE;
+				set_current_state(TASK_INTERRUPTIBLE);
+				continue;
 			}
 
+			surplus = (tq->tq_nthreads > 1 &&
+			    list_first_entry(&tq->tq_thread_list,
+			    taskq_thread_t, tqt_thread_list) != tqt);
 			add_wait_queue_exclusive(&tq->tq_work_waitq, &wait);
 			spin_unlock_irqrestore(&tq->tq_lock, flags);
 
-			schedule();
+			/* Ingress tasks are pushed without the lock */
+			if (!llist_empty(&tq->tq_ingress))
+				__set_current_state(TASK_RUNNING);
+
+			/*
+			 * Threads of a dynamic taskq above the first wake to
+			 * check if they are surplus, the first never exits.
+			 */
+			if ((tq->tq_flags & TASKQ_DYNAMIC) && surplus) {
+				schedule_timeout(msecs_to_jiffies(
+				    MAX(spl_taskq_thread_linger_ms, 1)));
+			} else {
+				schedule();
+			}
 			seq_tasks = 0;
 
 			spin_lock_irqsave_nested(&tq->tq_lock, flags,
@@ -914,61 +2380,14 @@ taskq_thread(void *args)
 		}
 
 		if ((t = taskq_next_ent(tq)) != NULL) {
-			list_del_init(&t->tqent_list);
-
-			/*
-			 * A TQENT_FLAG_PREALLOC task may be reused or freed
-			 * during the task function call. Store tqent_id and
-			 * tqent_flags here.
-			 *
-			 * Also use an on stack taskq_ent_t for tqt_task
-			 * assignment in this case. We only populate the two
-			 * fields used by the only user in taskq proc file.
-			 */
-			tqt->tqt_id = t->tqent_id;
-			tqt->tqt_flags = t->tqent_flags;
-
-			if (t->tqent_flags & TQENT_FLAG_PREALLOC) {
-				dup_task.tqent_func = t->tqent_func;
-				dup_task.tqent_arg = t->tqent_arg;
-				t = &dup_task;
-			}
-			tqt->tqt_task = t;
-
-			taskq_insert_in_order(tq, tqt);
-			tq->tq_nactive++;
-			spin_unlock_irqrestore(&tq->tq_lock, flags);
-
-			/* Perform the requested task */
-			t->tqent_func(t->tqent_arg);
-
-			spin_lock_irqsave_nested(&tq->tq_lock, flags,
-			    tq->tq_lock_class);
-			tq->tq_nactive--;
-			list_del_init(&tqt->tqt_active_list);
-			tqt->tqt_task = NULL;
-
-			/* For prealloc'd tasks, we don't free anything. */
-			if (!(tqt->tqt_flags & TQENT_FLAG_PREALLOC))
-				task_done(tq, t);
-
-			/*
-			 * When the current lowest outstanding taskqid is
-			 * done calculate the new lowest outstanding id
-			 */
-			if (tq->tq_lowest_id == tqt->tqt_id) {
-				tq->tq_lowest_id = taskq_lowest_id(tq);
-				ASSERT3S(tq->tq_lowest_id, >, tqt->tqt_id);
-			}
+			taskq_thread_run(tq, tqt, t, &dup_task, &flags);
+			polled = B_FALSE;
 
 			/* Spawn additional taskq threads if required. */
 			if ((++seq_tasks) > spl_taskq_thread_sequential &&
-			    taskq_thread_spawn(tq))
+			    tq->tq_nthreads + tq->tq_nspawn <
+			    tq->tq_ctl_target && taskq_thread_spawn(tq))
 				seq_tasks = 0;
-
-			tqt->tqt_id = TASKQID_INVALID;
-			tqt->tqt_flags = 0;
-			wake_up_all(&tq->tq_wait_waitq);
 		} else {
 			if (taskq_thread_should_stop(tq, tqt))
 				break;
@@ -980,16 +2399,50 @@ taskq_thread(void *args)
 
 	__set_current_state(TASK_RUNNING);
 	tq->tq_nthreads--;
+	this_cpu_inc(tq->tq_stats->tqs_exited);
+	taskq_thread_usage(current, &tq->tq_usage);
 	list_del_init(&tqt->tqt_thread_list);
 error:
-	kmem_free(tqt, sizeof (taskq_thread_t));
 	spin_unlock_irqrestore(&tq->tq_lock, flags);
 
 	tsd_set(taskq_tsd, NULL);
+	kmem_free(tqt, sizeof (taskq_thread_t));
 
 	return (0);
 }
 
+/*
+ * Restrict a new thread of a taskq created with a cpumask to those CPUs.
+ * When spl_taskq_thread_bind is set each thread is bound to a single CPU,
+ * taken round-robin from the online CPUs in the mask, otherwise the
+ * scheduler may run it on any of them.
+ */
+static void
+taskq_thread_affine(taskq_t *tq, struct task_struct *tsk)
+{
+	unsigned long irqflags;
+	int cpu = nr_cpu_ids;
+
+	if (spl_taskq_thread_bind) {
+		spin_lock_irqsave_nested(&tq->tq_lock, irqflags,
+		    tq->tq_lock_class);
+		cpu = cpumask_next_and(tq->tq_cpu_next, tq->tq_cpumask,
+		    cpu_online_mask);
+		if (cpu >= nr_cpu_ids) {
+			cpu = cpumask_next_and(-1, tq->tq_cpumask,
+			    cpu_online_mask);
+		}
+		if (cpu < nr_cpu_ids)
+			tq->tq_cpu_next = cpu;
+		spin_unlock_irqrestore(&tq->tq_lock, irqflags);
+	}
+
+	if (cpu < nr_cpu_ids)
+		kthread_bind(tsk, cpu);
+	else
+		(void) set_cpus_allowed_ptr(tsk, tq->tq_cpumask);
+}
+
 static taskq_thread_t *
 taskq_thread_create(taskq_t *tq)
 {
@@ -999,8 +2452,11 @@ taskq_thread_create(taskq_t *tq)
 	tqt = kmem_alloc(sizeof (*tqt), KM_PUSHPAGE);
 	INIT_LIST_HEAD(&tqt->tqt_thread_list);
 	INIT_LIST_HEAD(&tqt->tqt_active_list);
+	INIT_LIST_HEAD(&tqt->tqt_poll_list);
+	tqt->tqt_polling = 0;
 	tqt->tqt_tq = tq;
 	tqt->tqt_id = TASKQID_INVALID;
+	tqt->tqt_idle = jiffies;
 
 	tqt->tqt_thread = spl_kthread_create(taskq_thread, tqt,
 	    "%s", tq->tq_name);
@@ -1009,7 +2465,9 @@ taskq_thread_create(taskq_t *tq)
 		return (NULL);
 	}
 
-	if (spl_taskq_thread_bind) {
+	if (tq->tq_cpumask != NULL) {
+		taskq_thread_affine(tq, tqt->tqt_thread);
+	} else if (spl_taskq_thread_bind) {
 		last_used_cpu = (last_used_cpu + 1) % num_online_cpus();
 		kthread_bind(tqt->tqt_thread, last_used_cpu);
 	}
@@ -1022,12 +2480,349 @@ taskq_thread_create(taskq_t *tq)
 	return (tqt);
 }
 
-taskq_t *
-taskq_create(const char *name, int nthreads, pri_t pri,
-    int minalloc, int maxalloc, uint_t flags)
+/*
+ * Divide the CPUs in the mask in to groups of at most cpus CPUs which
+ * share a NUMA node.  When map is given the group of each CPU is stored
+ * in it.  Returns the number of groups.
+ */
+static int
+taskq_shard_groups(const struct cpumask *mask, int cpus, int *map)
+{
+	int node, cpu, n, ngroups = 0;
+
+	for_each_node(node) {
+		n = 0;
+		for_each_cpu(cpu, mask) {
+			if (cpu_to_node(cpu) != node)
+				continue;
+
+			if (map != NULL)
+				map[cpu] = ngroups + n / cpus;
+
+			n++;
+		}
+
+		ngroups += DIV_ROUND_UP(n, cpus);
+	}
+
+	return (ngroups);
+}
+
+/*
+ * Build the table of the shard serving each possible CPU.  The CPUs in
+ * the mask are divided in to node local groups which are assigned to the
+ * shards, the size of the groups is doubled until there are no more of
+ * them than shards.  Only when there are more nodes than shards will a
+ * shard serve CPUs from several nodes.  CPUs outside the mask are served
+ * by a shard on their own node when there is one.  Returns the number of
+ * shards.
+ */
+static int
+taskq_shard_map(const struct cpumask *mask, int *map, int limit)
+{
+	int cpus, ngroups, nshards, cpu, i;
+
+	cpus = MAX(spl_taskq_shard_cpus, 1);
+	while ((ngroups = taskq_shard_groups(mask, cpus, NULL)) > limit &&
+	    cpus < nr_cpu_ids)
+		cpus *= 2;
+
+	nshards = MAX(MIN(ngroups, limit), 1);
+
+	for (cpu = 0; cpu < nr_cpu_ids; cpu++)
+		map[cpu] = -1;
+
+	(void) taskq_shard_groups(mask, cpus, map);
+
+	for_each_cpu(cpu, mask)
+		map[cpu] %= nshards;
+
+	for_each_possible_cpu(cpu) {
+		if (map[cpu] >= 0)
+			continue;
+
+		map[cpu] = cpu % nshards;
+		for_each_cpu(i, mask) {
+			if (cpu_to_node(i) == cpu_to_node(cpu)) {
+				map[cpu] = map[i];
+				break;
+			}
+		}
+	}
+
+	return (nshards);
+}
+
+/*
+ * Each taskq publishes its statistics in a taskq/<name>.<instance> kstat.
+ * The per-CPU counters and the scheduler accounting of the taskq threads
+ * are summed in to a snapshot when it is read.
+ */
+typedef struct taskq_kstat {
+	taskq_stats_t		tqk_stats;
+	taskq_usage_t		tqk_usage;
+	uint64_t		tqk_depth;
+	uint64_t		tqk_maxdepth;
+	uint64_t		tqk_threads;
+	uint64_t		tqk_stolen;
+} taskq_kstat_t;
+
+static int
+taskq_kstat_update(kstat_t *ksp, int rw)
+{
+	taskq_t *tq = ksp->ks_private;
+	taskq_kstat_t *tqk = ksp->ks_data;
+	taskq_stats_t *tqs;
+	taskq_thread_t *tqt;
+	unsigned long flags;
+	int cpu, i;
+
+	if (rw == KSTAT_WRITE)
+		return (EACCES);
+
+	memset(tqk, 0, sizeof (taskq_kstat_t));
+
+	for_each_possible_cpu(cpu) {
+		tqs = per_cpu_ptr(tq->tq_stats, cpu);
+		tqk->tqk_stats.tqs_dispatched += tqs->tqs_dispatched;
+		tqk->tqk_stats.tqs_completed += tqs->tqs_completed;
+		tqk->tqk_stats.tqs_canceled += tqs->tqs_canceled;
+		tqk->tqk_stats.tqs_spawned += tqs->tqs_spawned;
+		tqk->tqk_stats.tqs_exited += tqs->tqs_exited;
+		tqk->tqk_stats.tqs_throttled += tqs->tqs_throttled;
+		tqk->tqk_stats.tqs_overalloc += tqs->tqs_overalloc;
+
+		for (i = 0; i < TASKQ_HIST_BUCKETS; i++) {
+			tqk->tqk_stats.tqs_wait[i] += tqs->tqs_wait[i];
+			tqk->tqk_stats.tqs_exec[i] += tqs->tqs_exec[i];
+		}
+	}
+
+	/*
+	 * Threads add their usage to the taskq when they exit, the usage
+	 * of the running threads is sampled under the lock which keeps
+	 * them on the thread list.
+	 */
+	spin_lock_irqsave_nested(&tq->tq_lock, flags, tq->tq_lock_class);
+	tqk->tqk_usage = tq->tq_usage;
+	list_for_each_entry(tqt, &tq->tq_thread_list, tqt_thread_list) {
+		taskq_thread_usage(tqt->tqt_thread, &tqk->tqk_usage);
+		tqk->tqk_threads++;
+	}
+	tqk->tqk_stolen = tq->tq_nstolen;
+	tqk->tqk_depth = tq->tq_depth;
+	tqk->tqk_maxdepth = tq->tq_maxdepth;
+	spin_unlock_irqrestore(&tq->tq_lock, flags);
+
+	return (0);
+}
+
+static int
+taskq_kstat_data(char *buf, size_t size, void *data)
+{
+	taskq_kstat_t *tqk = data;
+	taskq_stats_t *tqs = &tqk->tqk_stats;
+	size_t n;
+	int i;
+
+	n = snprintf(buf, size,
+	    "%-16s %llu\n%-16s %llu\n%-16s %llu\n%-16s %llu\n"
+	    "%-16s %llu\n%-16s %llu\n%-16s %llu\n%-16s %llu\n"
+	    "%-16s %llu\n%-16s %llu\n%-16s %llu\n%-16s %llu\n"
+	    "%-16s %llu\n%-16s %llu\n%-16s %llu\n%-16s %llu\n"
+	    "\n%-16s %-16s %s\n",
+	    "dispatched", (u_longlong_t)tqs->tqs_dispatched,
+	    "completed", (u_longlong_t)tqs->tqs_completed,
+	    "canceled", (u_longlong_t)tqs->tqs_canceled,
+	    "depth", (u_longlong_t)tqk->tqk_depth,
+	    "max_depth", (u_longlong_t)tqk->tqk_maxdepth,
+	    "threads_spawned", (u_longlong_t)tqs->tqs_spawned,
+	    "threads_exited", (u_longlong_t)tqs->tqs_exited,
+	    "alloc_throttled", (u_longlong_t)tqs->tqs_throttled,
+	    "alloc_overmax", (u_longlong_t)tqs->tqs_overalloc,
+	    "threads", (u_longlong_t)tqk->tqk_threads,
+	    "threads_stolen", (u_longlong_t)tqk->tqk_stolen,
+	    "utime_ns", (u_longlong_t)tqk->tqk_usage.tqu_utime,
+	    "stime_ns", (u_longlong_t)tqk->tqk_usage.tqu_stime,
+	    "run_delay_ns", (u_longlong_t)tqk->tqk_usage.tqu_delay,
+	    "nvcsw", (u_longlong_t)tqk->tqk_usage.tqu_nvcsw,
+	    "nivcsw", (u_longlong_t)tqk->tqk_usage.tqu_nivcsw,
+	    "usec", "wait", "exec");
+
+	for (i = 0; i < TASKQ_HIST_BUCKETS && n < size; i++) {
+		n += snprintf(buf + n, size - n, "%-16llu %-16llu %llu\n",
+		    1ULL << i, (u_longlong_t)tqs->tqs_wait[i],
+		    (u_longlong_t)tqs->tqs_exec[i]);
+	}
+
+	return (n >= size ? ENOMEM : 0);
+}
+
+static void
+taskq_kstat_init(taskq_t *tq)
+{
+	char *name;
+
+	name = kmem_asprintf("%s.%d", tq->tq_name, tq->tq_instance);
+	tq->tq_ksp = kstat_create("taskq", 0, name, "misc", KSTAT_TYPE_RAW,
+	    sizeof (taskq_kstat_t), 0);
+	strfree(name);
+
+	if (tq->tq_ksp != NULL) {
+		tq->tq_ksp->ks_private = tq;
+		tq->tq_ksp->ks_update = taskq_kstat_update;
+		kstat_set_raw_ops(tq->tq_ksp, NULL, taskq_kstat_data, NULL);
+		kstat_install(tq->tq_ksp);
+	}
+}
+
+static void
+taskq_kstat_fini(taskq_t *tq)
+{
+	if (tq->tq_ksp != NULL) {
+		kstat_delete(tq->tq_ksp);
+		tq->tq_ksp = NULL;
+	}
+}
+
+static taskq_t *taskq_create_impl(const char *, int, pri_t, int, int, uint_t,
+    const struct cpumask *, int);
+static void taskq_free(taskq_t *);
+
+/*
+ * Create a sharded taskq.  The threads and taskq_ent_t limits are divided
+ * between the shards, each shard is always given at least one thread.
+ * The threads of each shard are restricted to the CPUs it serves.  The
+ * shards are not linked to their parent until all of them have been
+ * created so their threads cannot look for work in a partial set.
+ */
+static taskq_t *
+taskq_create_sharded(const char *name, int nthreads, pri_t pri,
+    int minalloc, int maxalloc, uint_t flags, const struct cpumask *mask,
+    int node)
+{
+	taskq_t *tq, *stq;
+	struct cpumask *smask;
+	char *sname;
+	int i, cpu, snode, nshards;
+	unsigned long irqflags;
+
+	tq = kmem_zalloc(sizeof (*tq), KM_PUSHPAGE);
+	if (tq == NULL)
+		return (NULL);
+
+	tq->tq_name = strdup(name);
+	tq->tq_shard_map = kmem_alloc(nr_cpu_ids * sizeof (int), KM_PUSHPAGE);
+	smask = kmem_alloc(cpumask_size(), KM_PUSHPAGE);
+	if (mask != NULL)
+		tq->tq_cpumask = kmem_alloc(cpumask_size(), KM_PUSHPAGE);
+
+	if (tq->tq_shard_map == NULL || smask == NULL ||
+	    (mask != NULL && tq->tq_cpumask == NULL)) {
+		if (smask != NULL)
+			kmem_free(smask, cpumask_size());
+		taskq_free(tq);
+		return (NULL);
+	}
+
+	if (mask != NULL)
+		cpumask_copy(tq->tq_cpumask, mask);
+	else
+		mask = cpu_possible_mask;
+
+	nshards = taskq_shard_map(mask, tq->tq_shard_map,
+	    MAX(MIN(nthreads, TASKQ_SHARD_MAX), 1));
+
+	tq->tq_shards = kmem_zalloc(nshards * sizeof (taskq_t *), KM_PUSHPAGE);
+	if (tq->tq_shards == NULL) {
+		kmem_free(smask, cpumask_size());
+		taskq_free(tq);
+		return (NULL);
+	}
+
+	spin_lock_init(&tq->tq_lock);
+	INIT_LIST_HEAD(&tq->tq_thread_list);
+	INIT_LIST_HEAD(&tq->tq_active_list);
+	INIT_LIST_HEAD(&tq->tq_free_list);
+	INIT_LIST_HEAD(&tq->tq_prio_list);
+	INIT_LIST_HEAD(&tq->tq_blocked_list);
+	INIT_LIST_HEAD(&tq->tq_poll_list);
+	INIT_LIST_HEAD(&tq->tq_taskqs);
+	init_waitqueue_head(&tq->tq_work_waitq);
+	init_waitqueue_head(&tq->tq_wait_waitq);
+	tq->tq_maxthreads = nthreads;
+	tq->tq_pri = pri;
+	tq->tq_minalloc = minalloc;
+	tq->tq_maxalloc = maxalloc;
+	tq->tq_flags = (flags | TASKQ_ACTIVE);
+	tq->tq_next_id = TASKQID_INITIAL;
+	INIT_LIST_HEAD(&tq->tq_outstanding);
+	tq->tq_lock_class = TQ_LOCK_GENERAL;
+	atomic_long_set(&tq->tq_id_seq, 0);
+	init_llist_head(&tq->tq_ingress);
+	atomic_set(&tq->tq_ningress, 0);
+	tq->tq_cpu_next = -1;
+	tq->tq_node = node;
+
+	for (i = 0; i < nshards; i++) {
+		cpumask_clear(smask);
+		snode = NUMA_NO_NODE;
+		for_each_cpu(cpu, mask) {
+			if (tq->tq_shard_map[cpu] != i)
+				continue;
+
+			if (cpumask_empty(smask))
+				snode = cpu_to_node(cpu);
+			else if (snode != cpu_to_node(cpu))
+				snode = NUMA_NO_NODE;
+
+			cpumask_set_cpu(cpu, smask);
+		}
+
+		sname = kmem_asprintf("%s_%d", name, i);
+		stq = taskq_create_impl(sname,
+		    nthreads / nshards + (i < nthreads % nshards), pri,
+		    minalloc / nshards, MAX(maxalloc / nshards, 1),
+		    flags & ~TASKQ_SHARDED, smask, snode);
+		strfree(sname);
+
+		if (stq == NULL)
+			break;
+
+		stq->tq_shard = i;
+		tq->tq_shards[tq->tq_nshards++] = stq;
+	}
+
+	kmem_free(smask, cpumask_size());
+
+	if (tq->tq_nshards != nshards) {
+		for (i = 0; i < tq->tq_nshards; i++)
+			taskq_destroy(tq->tq_shards[i]);
+
+		kmem_free(tq->tq_shards, nshards * sizeof (taskq_t *));
+		taskq_free(tq);
+		return (NULL);
+	}
+
+	for (i = 0; i < nshards; i++) {
+		stq = tq->tq_shards[i];
+		spin_lock_irqsave_nested(&stq->tq_lock, irqflags,
+		    stq->tq_lock_class);
+		stq->tq_parent = tq;
+		spin_unlock_irqrestore(&stq->tq_lock, irqflags);
+	}
+
+	return (tq);
+}
+
+static taskq_t *
+taskq_create_impl(const char *name, int nthreads, pri_t pri,
+    int minalloc, int maxalloc, uint_t flags, const struct cpumask *mask,
+    int node)
 {
 	taskq_t *tq;
 	taskq_thread_t *tqt;
+	taskq_ent_cache_t *tqec;
 	int count = 0, rc = 0, i;
 	unsigned long irqflags;
 
@@ -1042,18 +2837,63 @@ taskq_create(const char *name, int nthreads, pri_t pri,
 		ASSERT(nthreads >= 0);
 		nthreads = MIN(nthreads, 100);
 		nthreads = MAX(nthreads, 0);
-		nthreads = MAX((num_online_cpus() * nthreads) / 100, 1);
+		nthreads = MAX(((mask ? cpumask_weight(mask) :
+		    num_online_cpus()) * nthreads) / 100, 1);
+	}
+
+	if (flags & TASKQ_SHARDED) {
+		return (taskq_create_sharded(name, nthreads, pri, minalloc,
+		    maxalloc, flags & ~TASKQ_THREADS_CPU_PCT, mask, node));
 	}
 
 	tq = kmem_alloc(sizeof (*tq), KM_PUSHPAGE);
 	if (tq == NULL)
 		return (NULL);
 
+	tq->tq_id_hash_bits = MIN(MAX(spl_taskq_id_hash_bits, 1),
+	    TASKQ_ID_HASH_BITS_MAX);
+	tq->tq_id_hash = kmem_alloc(sizeof (struct hlist_head) <<
+	    tq->tq_id_hash_bits, KM_PUSHPAGE);
+	if (tq->tq_id_hash == NULL) {
+		kmem_free(tq, sizeof (*tq));
+		return (NULL);
+	}
+
+	for (i = 0; i < (1 << tq->tq_id_hash_bits); i++)
+		INIT_HLIST_HEAD(&tq->tq_id_hash[i]);
+
+	tq->tq_cpumask = NULL;
+	if (mask != NULL) {
+		tq->tq_cpumask = kmem_alloc(cpumask_size(), KM_PUSHPAGE);
+		if (tq->tq_cpumask == NULL) {
+			kmem_free(tq->tq_id_hash,
+			    sizeof (struct hlist_head) << tq->tq_id_hash_bits);
+			kmem_free(tq, sizeof (*tq));
+			return (NULL);
+		}
+
+		cpumask_copy(tq->tq_cpumask, mask);
+	}
+
+	tq->tq_stats = alloc_percpu(taskq_stats_t);
+	tq->tq_ent_cache = alloc_percpu(taskq_ent_cache_t);
+	if (tq->tq_stats == NULL || tq->tq_ent_cache == NULL) {
+		free_percpu(tq->tq_ent_cache);
+		free_percpu(tq->tq_stats);
+		if (tq->tq_cpumask != NULL)
+			kmem_free(tq->tq_cpumask, cpumask_size());
+		kmem_free(tq->tq_id_hash,
+		    sizeof (struct hlist_head) << tq->tq_id_hash_bits);
+		kmem_free(tq, sizeof (*tq));
+		return (NULL);
+	}
+
 	spin_lock_init(&tq->tq_lock);
 	INIT_LIST_HEAD(&tq->tq_thread_list);
 	INIT_LIST_HEAD(&tq->tq_active_list);
 	tq->tq_name = strdup(name);
 	tq->tq_nactive = 0;
+	tq->tq_nstolen = 0;
 	tq->tq_nthreads = 0;
 	tq->tq_nspawn = 0;
 	tq->tq_maxthreads = nthreads;
@@ -1063,15 +2903,55 @@ taskq_create(const char *name, int nthreads, pri_t pri,
 	tq->tq_nalloc = 0;
 	tq->tq_flags = (flags | TASKQ_ACTIVE);
 	tq->tq_next_id = TASKQID_INITIAL;
-	tq->tq_lowest_id = TASKQID_INITIAL;
+	INIT_LIST_HEAD(&tq->tq_outstanding);
 	INIT_LIST_HEAD(&tq->tq_free_list);
-	INIT_LIST_HEAD(&tq->tq_pend_list);
+	for_each_possible_cpu(i) {
+		tqec = per_cpu_ptr(tq->tq_ent_cache, i);
+		INIT_LIST_HEAD(&tqec->tqec_list);
+		tqec->tqec_count = 0;
+		init_llist_head(&tqec->tqec_remote);
+		atomic_set(&tqec->tqec_nremote, 0);
+	}
 	INIT_LIST_HEAD(&tq->tq_prio_list);
-	INIT_LIST_HEAD(&tq->tq_delay_list);
+	INIT_LIST_HEAD(&tq->tq_blocked_list);
+	INIT_LIST_HEAD(&tq->tq_poll_list);
+	for (i = 0; i < TASKQ_CLASS_MAX; i++) {
+		INIT_LIST_HEAD(&tq->tq_pend_list[i]);
+		tq->tq_class_weight[i] = 1;
+	}
+	tq->tq_class_cur = 0;
+	tq->tq_class_credit = 1;
+	tq->tq_wheel = NULL;
+#ifdef HAVE_KERNEL_TIMER_FUNCTION_TIMER_LIST
+	timer_setup(&tq->tq_delay_timer, task_expire, 0);
+#else
+	setup_timer(&tq->tq_delay_timer, task_expire, (unsigned long)tq);
+#endif
+	tq->tq_npollers = 0;
 	init_waitqueue_head(&tq->tq_work_waitq);
 	init_waitqueue_head(&tq->tq_wait_waitq);
 	tq->tq_lock_class = TQ_LOCK_GENERAL;
 	INIT_LIST_HEAD(&tq->tq_taskqs);
+	tq->tq_parent = NULL;
+	tq->tq_shards = NULL;
+	tq->tq_nshards = 0;
+	tq->tq_shard = 0;
+	atomic_long_set(&tq->tq_id_seq, 0);
+	init_llist_head(&tq->tq_ingress);
+	atomic_set(&tq->tq_ningress, 0);
+	tq->tq_shard_map = NULL;
+	tq->tq_cpu_next = -1;
+	tq->tq_node = node;
+	tq->tq_depth = 0;
+	tq->tq_maxdepth = 0;
+	memset(&tq->tq_usage, 0, sizeof (taskq_usage_t));
+	tq->tq_ksp = NULL;
+	tq->tq_ctl_time = jiffies;
+	tq->tq_ctl_arrivals = 0;
+	tq->tq_ctl_done = 0;
+	tq->tq_ctl_busy = 0;
+	tq->tq_ctl_load = 0;
+	tq->tq_ctl_target = 1;
 
 	if (flags & TASKQ_PREPOPULATE) {
 		spin_lock_irqsave_nested(&tq->tq_lock, irqflags,
@@ -1111,34 +2991,146 @@ taskq_create(const char *name, int nthreads, pri_t pri,
 		tq->tq_instance = taskq_find_by_name(name) + 1;
 		list_add_tail(&tq->tq_taskqs, &tq_list);
 		up_write(&tq_list_sem);
+
+		taskq_kstat_init(tq);
 	}
 
 	return (tq);
 }
+
+taskq_t *
+taskq_create(const char *name, int nthreads, pri_t pri,
+    int minalloc, int maxalloc, uint_t flags)
+{
+	return (taskq_create_impl(name, nthreads, pri, minalloc, maxalloc,
+	    flags, NULL, NUMA_NO_NODE));
+}
 EXPORT_SYMBOL(taskq_create);
 
+/*
+ * Create a taskq whose threads only run on the CPUs in the mask.  When
+ * spl_taskq_thread_bind is set they are spread evenly over those CPUs.
+ * A TASKQ_SHARDED taskq has its shards built from node local groups of
+ * the CPUs, see taskq_dispatch_node().
+ */
+taskq_t *
+taskq_create_cpumask(const char *name, int nthreads, pri_t pri,
+    int minalloc, int maxalloc, uint_t flags, const struct cpumask *mask)
+{
+	ASSERT(mask != NULL);
+
+	return (taskq_create_impl(name, nthreads, pri, minalloc, maxalloc,
+	    flags, mask, NUMA_NO_NODE));
+}
+EXPORT_SYMBOL(taskq_create_cpumask);
+
+/*
+ * Create a taskq whose threads only run on the CPUs of a NUMA node.  An
+ * offline node or NUMA_NO_NODE creates an ordinary taskq.
+ */
+taskq_t *
+taskq_create_node(const char *name, int nthreads, pri_t pri,
+    int minalloc, int maxalloc, uint_t flags, int node)
+{
+	if (node == NUMA_NO_NODE || !node_online(node)) {
+		return (taskq_create(name, nthreads, pri, minalloc, maxalloc,
+		    flags));
+	}
+
+	return (taskq_create_impl(name, nthreads, pri, minalloc, maxalloc,
+	    flags, cpumask_of_node(node), node));
+}
+EXPORT_SYMBOL(taskq_create_node);
+
+static void
+taskq_free(taskq_t *tq)
+{
+	if (tq->tq_id_hash != NULL) {
+		kmem_free(tq->tq_id_hash,
+		    sizeof (struct hlist_head) << tq->tq_id_hash_bits);
+	}
+
+	if (tq->tq_wheel != NULL)
+		kmem_free(tq->tq_wheel, sizeof (taskq_wheel_t));
+
+	if (tq->tq_shard_map != NULL)
+		kmem_free(tq->tq_shard_map, nr_cpu_ids * sizeof (int));
+
+	if (tq->tq_cpumask != NULL)
+		kmem_free(tq->tq_cpumask, cpumask_size());
+
+	if (tq->tq_stats != NULL)
+		free_percpu(tq->tq_stats);
+
+	if (tq->tq_ent_cache != NULL)
+		free_percpu(tq->tq_ent_cache);
+
+	strfree(tq->tq_name);
+	kmem_free(tq, sizeof (taskq_t));
+}
+
+/*
+ * The shards are destroyed one at a time but only freed once they have all
+ * been stopped, a thread from a remaining shard may still be inspecting an
+ * already destroyed sibling for pending work.
+ */
+static void
+taskq_destroy_sharded(taskq_t *tq)
+{
+	taskq_t *stq;
+	int i;
+
+	tq->tq_flags &= ~TASKQ_ACTIVE;
+
+	for (i = 0; i < tq->tq_nshards; i++)
+		taskq_destroy(tq->tq_shards[i]);
+
+	for (i = 0; i < tq->tq_nshards; i++)
+		taskq_free(tq->tq_shards[i]);
+
+	kmem_free(tq->tq_shards, tq->tq_nshards * sizeof (taskq_t *));
+	taskq_free(tq);
+}
+
 void
 taskq_destroy(taskq_t *tq)
 {
 	struct task_struct *thread;
 	taskq_thread_t *tqt;
-	taskq_ent_t *t;
+	taskq_ent_cache_t *tqec;
+	struct llist_node *node;
+	taskq_ent_t *t, *n;
 	unsigned long flags;
+	int i;
 
 	ASSERT(tq);
+
+	if (taskq_is_sharded(tq)) {
+		taskq_destroy_sharded(tq);
+		return;
+	}
+
 	spin_lock_irqsave_nested(&tq->tq_lock, flags, tq->tq_lock_class);
 	tq->tq_flags &= ~TASKQ_ACTIVE;
 	spin_unlock_irqrestore(&tq->tq_lock, flags);
 
 	/*
 	 * When TASKQ_ACTIVE is clear new tasks may not be added nor may
-	 * new worker threads be spawned for dynamic taskq.
+	 * new worker threads be spawned for dynamic taskq.  Interrupt
+	 * dispatches which observed TASKQ_ACTIVE before it was cleared
+	 * may still be pushing to the ingress list, let them finish.
 	 */
+	smp_mb();
+	while (atomic_read(&tq->tq_ningress) > 0)
+		cpu_relax();
+
 	if (dynamic_taskq != NULL)
 		taskq_wait_outstanding(dynamic_taskq, 0);
 
 	taskq_wait(tq);
 
+	taskq_kstat_fini(tq);
+
 	/* remove taskq from global list used by the kstats */
 	down_write(&tq_list_sem);
 	list_del(&tq->tq_taskqs);
@@ -1171,6 +3163,18 @@ taskq_destroy(taskq_t *tq)
 		    tq->tq_lock_class);
 	}
 
+	/* Return the entries cached by each CPU to the free list */
+	for_each_possible_cpu(i) {
+		tqec = per_cpu_ptr(tq->tq_ent_cache, i);
+		list_splice_tail_init(&tqec->tqec_list, &tq->tq_free_list);
+		tqec->tqec_count = 0;
+
+		node = llist_del_all(&tqec->tqec_remote);
+		llist_for_each_entry_safe(t, n, node, tqent_llist)
+			list_add_tail(&t->tqent_list, &tq->tq_free_list);
+		atomic_set(&tqec->tqec_nremote, 0);
+	}
+
 	while (!list_empty(&tq->tq_free_list)) {
 		t = list_entry(tq->tq_free_list.next, taskq_ent_t, tqent_list);
 
@@ -1183,20 +3187,58 @@ taskq_destroy(taskq_t *tq)
 	ASSERT0(tq->tq_nthreads);
 	ASSERT0(tq->tq_nalloc);
 	ASSERT0(tq->tq_nspawn);
+	ASSERT0(tq->tq_npollers);
+	ASSERT0(tq->tq_nstolen);
 	ASSERT(list_empty(&tq->tq_thread_list));
 	ASSERT(list_empty(&tq->tq_active_list));
 	ASSERT(list_empty(&tq->tq_free_list));
-	ASSERT(list_empty(&tq->tq_pend_list));
+	ASSERT3P(taskq_class_next(tq), ==, NULL);
 	ASSERT(list_empty(&tq->tq_prio_list));
-	ASSERT(list_empty(&tq->tq_delay_list));
+	ASSERT(list_empty(&tq->tq_blocked_list));
+	ASSERT(llist_empty(&tq->tq_ingress));
+	ASSERT0(atomic_read(&tq->tq_ningress));
+	ASSERT(tq->tq_wheel == NULL || tq->tq_wheel->tqw_count == 0);
+	ASSERT(list_empty(&tq->tq_outstanding));
 
 	spin_unlock_irqrestore(&tq->tq_lock, flags);
 
-	strfree(tq->tq_name);
-	kmem_free(tq, sizeof (taskq_t));
+	/* The wheel is empty but the delay timer may still be pending */
+	del_timer_sync(&tq->tq_delay_timer);
+
+	/* Shards are freed by taskq_destroy_sharded() */
+	if (tq->tq_parent == NULL)
+		taskq_free(tq);
 }
 EXPORT_SYMBOL(taskq_destroy);
 
+/*
+ * Set the number of tasks a class may run each time it is served, the
+ * default weight of every class is one.  Weights are relative, a class
+ * with weight four is given four times the share of the taskq's threads
+ * of a class with weight one when both have pending tasks.  Priority
+ * tasks are run outside of the rotation and are not charged to any class.
+ */
+void
+taskq_set_class_weight(taskq_t *tq, int class, int weight)
+{
+	unsigned long flags;
+	int i;
+
+	ASSERT3S(class, >=, 0);
+	ASSERT3S(class, <, TASKQ_CLASS_MAX);
+
+	if (taskq_is_sharded(tq)) {
+		for (i = 0; i < tq->tq_nshards; i++)
+			taskq_set_class_weight(tq->tq_shards[i], class, weight);
+		return;
+	}
+
+	spin_lock_irqsave_nested(&tq->tq_lock, flags, tq->tq_lock_class);
+	tq->tq_class_weight[class] = MAX(weight, 1);
+	spin_unlock_irqrestore(&tq->tq_lock, flags);
+}
+EXPORT_SYMBOL(taskq_set_class_weight);
+
 
 static unsigned int spl_taskq_kick = 0;
 